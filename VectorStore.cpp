@@ -12,6 +12,99 @@ void printNSpace(int n) {
     }
 }
 
+// =====================================
+// Node allocator implementation
+// =====================================
+
+void* HeapNodeAllocator::allocate(size_t bytes) {
+    return ::operator new(bytes);
+}
+
+void HeapNodeAllocator::deallocate(void* block, size_t) {
+    ::operator delete(block);
+}
+
+SlabNodeAllocator::SlabNodeAllocator() : largeBlocks(nullptr) {
+    for (size_t i = 0; i < CLASS_COUNT; ++i) {
+        freeLists[i] = nullptr;
+        bumpBegin[i] = bumpEnd[i] = nullptr;
+    }
+}
+
+SlabNodeAllocator::~SlabNodeAllocator() {
+    this->releaseAll();
+}
+
+void* SlabNodeAllocator::allocate(size_t bytes) {
+    if (bytes == 0) bytes = 1;
+
+    size_t cls = sizeClass(bytes);
+    if (cls >= CLASS_COUNT) {
+        LargeBlock* large = static_cast<LargeBlock*>(::operator new(LARGE_HEADER + bytes));
+        large->prev = nullptr;
+        large->next = largeBlocks;
+        if (largeBlocks) largeBlocks->prev = large;
+        largeBlocks = large;
+        return reinterpret_cast<char*>(large) + LARGE_HEADER;
+    }
+
+    // Recycled block first
+    if (freeLists[cls]) {
+        FreeBlock* block = freeLists[cls];
+        freeLists[cls] = block->next;
+        return block;
+    }
+
+    size_t blockBytes = (cls + 1) * GRANULARITY;
+    if (bumpEnd[cls] - bumpBegin[cls] < (ptrdiff_t)blockBytes) {
+        char* slab = static_cast<char*>(::operator new(SLAB_BYTES));
+        slabs.push_back(slab);
+        bumpBegin[cls] = slab;
+        bumpEnd[cls] = slab + SLAB_BYTES;
+    }
+
+    void* block = bumpBegin[cls];
+    bumpBegin[cls] += blockBytes;
+    return block;
+}
+
+void SlabNodeAllocator::deallocate(void* block, size_t bytes) {
+    if (!block) return;
+    if (bytes == 0) bytes = 1;
+
+    size_t cls = sizeClass(bytes);
+    if (cls >= CLASS_COUNT) {
+        LargeBlock* large = reinterpret_cast<LargeBlock*>(static_cast<char*>(block) - LARGE_HEADER);
+        if (large->prev) large->prev->next = large->next;
+        else largeBlocks = large->next;
+        if (large->next) large->next->prev = large->prev;
+        ::operator delete(large);
+        return;
+    }
+
+    FreeBlock* freed = static_cast<FreeBlock*>(block);
+    freed->next = freeLists[cls];
+    freeLists[cls] = freed;
+}
+
+void SlabNodeAllocator::releaseAll() {
+    for (void* slab : slabs) {
+        ::operator delete(slab);
+    }
+    slabs.clear();
+
+    while (largeBlocks) {
+        LargeBlock* next = largeBlocks->next;
+        ::operator delete(largeBlocks);
+        largeBlocks = next;
+    }
+
+    for (size_t i = 0; i < CLASS_COUNT; ++i) {
+        freeLists[i] = nullptr;
+        bumpBegin[i] = bumpEnd[i] = nullptr;
+    }
+}
+
 // =====================================
 // AVLTree<K, T> implementation
 // =====================================
@@ -44,7 +137,7 @@ void AVLTree<K, T>::printTreeStructure() const {
 			}
 			else
 			{
-				cout << temp->data;
+				cout << temp->data();
 				q.push(temp->pLeft);
 				q.push(temp->pRight);
 			}
@@ -66,6 +159,19 @@ void AVLTree<K, T>::printTreeStructure() const {
 
 
 //TODO: Implement all AVLTree<K, T> methods here
+template <class K, class T>
+typename AVLTree<K, T>::AVLNode* AVLTree<K, T>::createNode(const K& key, const T& value) {
+    void* block = allocator->allocate(sizeof(AVLNode));
+    return new (block) AVLNode(key, value, allocator);
+}
+
+template <class K, class T>
+void AVLTree<K, T>::destroyNode(AVLNode* node) {
+    node->payload.destroy(allocator, true);
+    node->~AVLNode();
+    allocator->deallocate(node, sizeof(AVLNode));
+}
+
 template <class K, class T>
 typename AVLTree<K, T>::AVLNode* AVLTree<K, T>::rotateRight(AVLNode*& node) {
     if (!node || !node->pLeft) return node;
@@ -76,6 +182,9 @@ typename AVLTree<K, T>::AVLNode* AVLTree<K, T>::rotateRight(AVLNode*& node) {
     x->pRight = node;
     node->pLeft = r;
 
+    updateNode(node);
+    updateNode(x);
+
     return x;
 }
 
@@ -89,29 +198,39 @@ typename AVLTree<K, T>::AVLNode* AVLTree<K, T>::rotateLeft(AVLNode*& node) {
     y->pLeft = node;
     node->pRight = l;
 
+    updateNode(node);
+    updateNode(y);
+
     return y;
 }
 
 template <class K, class T>
-int AVLTree<K, T>::height(AVLNode* node) {
-    if (!node) return 0;
-    return 1 + max(height(node->pLeft), height(node->pRight));
+void AVLTree<K, T>::updateNode(AVLNode* node) {
+    int lHeight = height(node->pLeft);
+    int rHeight = height(node->pRight);
+
+    node->height = 1 + max(lHeight, rHeight);
+    node->size = 1 + nodeSize(node->pLeft) + nodeSize(node->pRight);
+
+    if (lHeight > rHeight) node->balance = LH;
+    else if (lHeight < rHeight) node->balance = RH;
+    else node->balance = EH;
 }
 
+// Height difference (left - right) from the cached child heights
 template <class K, class T>
-BalanceValue AVLTree<K, T>::getBalance(AVLNode* node) {
-    int lHeight = height(node->pLeft);
-    int rHeight = height(node->pRight);
-    BalanceValue balance = (BalanceValue)(lHeight - rHeight);
-    return balance;
+int AVLTree<K, T>::getBalance(AVLNode* node) {
+    return height(node->pLeft) - height(node->pRight);
 }
 
 template <class K, class T>
 typename AVLTree<K, T>::AVLNode* AVLTree<K, T>::insertHelper(AVLNode* node, const K& key, const T& value) {
     if (!node) {
-        return new AVLNode(key, value);
+        return createNode(key, value);
     }
 
+    TREE_PREFETCH(node->pLeft);
+    TREE_PREFETCH(node->pRight);
     if (key < node->key) {
         node->pLeft = insertHelper(node->pLeft, key, value);
     } else if (key > node->key) {
@@ -120,23 +239,24 @@ typename AVLTree<K, T>::AVLNode* AVLTree<K, T>::insertHelper(AVLNode* node, cons
         return node;
     }
 
-    node->balance = getBalance(node);
+    updateNode(node);
+    int balance = getBalance(node);
 
     //Left-Left
-    if (node->balance > 1 && key < node->pLeft->key) {
+    if (balance > 1 && key < node->pLeft->key) {
         return rotateRight(node);
     }
     //Right-Right
-    if (node->balance < -1 && key > node->pRight->key) {
+    if (balance < -1 && key > node->pRight->key) {
         return rotateLeft(node);
     }
     //Left-Right
-    if (node->balance > 1 && key > node->pLeft->key) {
+    if (balance > 1 && key > node->pLeft->key) {
         node->pLeft = rotateLeft(node->pLeft);
         return rotateRight(node);
     }
     //Right-Left
-    if (node->balance < -1 && key < node->pRight->key) {
+    if (balance < -1 && key < node->pRight->key) {
         node->pRight = rotateRight(node->pRight);
         return rotateLeft(node);
     }
@@ -158,6 +278,15 @@ typename AVLTree<K, T>::AVLNode* AVLTree<K, T>::minNode(AVLNode* node) {
     return current;
 }
 
+template <class K, class T>
+typename AVLTree<K, T>::AVLNode* AVLTree<K, T>::maxNode(AVLNode* node) {
+    AVLNode* current = node;
+
+    while (current->pRight) current = current->pRight;
+
+    return current;
+}
+
 template <class K, class T>
 typename AVLTree<K, T>::AVLNode* AVLTree<K, T>::removeHelper(AVLNode* node, const K& key) {
     if (!node) return node;
@@ -169,36 +298,36 @@ typename AVLTree<K, T>::AVLNode* AVLTree<K, T>::removeHelper(AVLNode* node, cons
         node->pRight = removeHelper(node->pRight, key);
     } else {
         if ((node->pLeft == nullptr) || (node->pRight == nullptr)) {
+            // The remaining child (if any) takes this node's place
             AVLNode* temp = node->pLeft ? node->pLeft : node->pRight;
-
-            if (!temp) {
-                temp = node;
-                node = nullptr;
-            } else *node = *temp;
-            delete temp;
+            destroyNode(node);
+            node = temp;
         } else {
             AVLNode* temp = minNode(node->pRight);
 
+            // Take over the successor's entry; it leaves with ours
             node->key = temp->key;
+            node->payload.swap(temp->payload);
             node->pRight = removeHelper(node->pRight, temp->key);
         }
     }
 
     if (!node) return node;
 
-    node->balance = getBalance(node);
+    updateNode(node);
+    int balance = getBalance(node);
 
-    if (node->balance > 1 && getBalance(node->pLeft) >= 0) {
+    if (balance > 1 && getBalance(node->pLeft) >= 0) {
         return rotateRight(node);
     }
-    if (node->balance < -1 && getBalance(node->pRight) <= 0) {
+    if (balance < -1 && getBalance(node->pRight) <= 0) {
         return rotateLeft(node);
     }
-    if (node->balance > 1 && getBalance(node->pLeft) < 0) {
+    if (balance > 1 && getBalance(node->pLeft) < 0) {
         node->pLeft = rotateLeft(node->pLeft);
         return rotateRight(node);
     }
-    if (node->balance < -1 && getBalance(node->pRight) > 0) {
+    if (balance < -1 && getBalance(node->pRight) > 0) {
         node->pRight = rotateRight(node->pRight);
         return rotateLeft(node);
     }
@@ -217,6 +346,8 @@ bool AVLTree<K, T>::contains(const K& key) const {
 
     AVLNode* current = this->root;
     while (current) {
+        TREE_PREFETCH(current->pLeft);
+        TREE_PREFETCH(current->pRight);
         if (key == current->key) return true;
 
         if (key < current->key) current = current->pLeft;
@@ -226,42 +357,124 @@ bool AVLTree<K, T>::contains(const K& key) const {
 }
 
 template <class K, class T>
-int AVLTree<K, T>::getHeight() const {
-    if (!this->root) return 0;
+typename AVLTree<K, T>::AVLNode* AVLTree<K, T>::select(int index) const {
+    if (index < 0 || index >= nodeSize(this->root)) return nullptr;
 
-    queue<AVLNode*> q;
-    q.push(this->root);
+    AVLNode* current = this->root;
+    while (current) {
+        int leftSize = nodeSize(current->pLeft);
 
-    int height = 0;
-    while (!q.empty()) {
-        int levelSize = q.size();
-        for (int i = 0; i < levelSize; ++i) {
-            AVLNode* current = q.front(); q.pop();
-            if (current->pLeft) q.push(current->pLeft);
-            if (current->pRight) q.push(current->pRight);
+        if (index < leftSize) current = current->pLeft;
+        else if (index > leftSize) {
+            index -= leftSize + 1;
+            current = current->pRight;
         }
-        ++height;
+        else return current;
     }
+    return nullptr;
+}
 
-    return height;
+template <class K, class T>
+int AVLTree<K, T>::rank(const K& key) const {
+    int res = 0;
+
+    AVLNode* current = this->root;
+    while (current) {
+        TREE_PREFETCH(current->pRight);
+        if (key > current->key) {
+            res += nodeSize(current->pLeft) + 1;
+            current = current->pRight;
+        }
+        else current = current->pLeft;
+    }
+    return res;
 }
 
 template <class K, class T>
-int AVLTree<K, T>::getSize() const {
-    if (!this->root) return 0;
+typename AVLTree<K, T>::Iterator AVLTree<K, T>::begin() const {
+    Iterator it(this->root);
+    it.pushLeftmost(this->root);
+    return it;
+}
 
-    queue<AVLNode*> q;
-    q.push(this->root);
+template <class K, class T>
+typename AVLTree<K, T>::Iterator AVLTree<K, T>::lowerBound(const K& key) const {
+    Iterator it(this->root);
+    size_t found = 0;
 
-    int size = 0;
-    while (!q.empty()) {
-        AVLNode* current = q.front(); q.pop();
-        if (current->pLeft) q.push(current->pLeft);
-        if (current->pRight) q.push(current->pRight);
-        ++size;
+    AVLNode* current = this->root;
+    while (current) {
+        TREE_PREFETCH(current->pLeft);
+        TREE_PREFETCH(current->pRight);
+        it.path.push_back(current);
+        if (current->key >= key) {
+            found = it.path.size();
+            current = current->pLeft;
+        }
+        else current = current->pRight;
     }
 
-    return size;
+    it.path.resize(found);
+    return it;
+}
+
+template <class K, class T>
+typename AVLTree<K, T>::Iterator AVLTree<K, T>::upperBound(const K& key) const {
+    Iterator it(this->root);
+    size_t found = 0;
+
+    AVLNode* current = this->root;
+    while (current) {
+        TREE_PREFETCH(current->pLeft);
+        TREE_PREFETCH(current->pRight);
+        it.path.push_back(current);
+        if (current->key > key) {
+            found = it.path.size();
+            current = current->pLeft;
+        }
+        else current = current->pRight;
+    }
+
+    it.path.resize(found);
+    return it;
+}
+
+template <class K, class T>
+typename AVLTree<K, T>::Iterator AVLTree<K, T>::floor(const K& key) const {
+    Iterator it(this->root);
+    size_t found = 0;
+
+    AVLNode* current = this->root;
+    while (current) {
+        TREE_PREFETCH(current->pLeft);
+        TREE_PREFETCH(current->pRight);
+        it.path.push_back(current);
+        if (current->key <= key) {
+            found = it.path.size();
+            current = current->pRight;
+        }
+        else current = current->pLeft;
+    }
+
+    it.path.resize(found);
+    return it;
+}
+
+template <class K, class T>
+typename AVLTree<K, T>::Iterator AVLTree<K, T>::last() const {
+    Iterator it(this->root);
+    it.pushRightmost(this->root);
+    return it;
+}
+
+template <class K, class T>
+int AVLTree<K, T>::getHeight() const {
+    return height(this->root);
+}
+
+template <class K, class T>
+int AVLTree<K, T>::getSize() const {
+    return nodeSize(this->root);
 }
 
 template <class K, class T>
@@ -269,18 +482,28 @@ bool AVLTree<K, T>::empty() const {
     return (!this->root? true : false);
 }
 
+// With releaseStorage == false only the destructors run; the caller hands
+// the storage back to the allocator in bulk afterwards
 template <class K, class T>
-void AVLTree<K, T>::clearHelper(AVLNode* node) {
+void AVLTree<K, T>::clearHelper(AVLNode* node, bool releaseStorage) {
 	if (!node) return;
 
-	clearHelper(node->pLeft);
-	clearHelper(node->pRight);
-	delete node;
+	clearHelper(node->pLeft, releaseStorage);
+	clearHelper(node->pRight, releaseStorage);
+	if (releaseStorage) destroyNode(node);
+	else {
+		node->payload.destroy(allocator, false);
+		node->~AVLNode();
+	}
 }
 
 template <class K, class T>
 void AVLTree<K, T>::clear() {
-	clearHelper(this->root);
+	if (ownsAllocator && allocator->supportsReleaseAll()) {
+		if (!is_trivially_destructible<K>::value || !is_trivially_destructible<T>::value) clearHelper(this->root, false);
+		allocator->releaseAll();
+	}
+	else clearHelper(this->root, true);
 	this->root = nullptr;
 }
 
@@ -289,7 +512,7 @@ void AVLTree<K, T>::inorderTraversalHelper(AVLNode* node, void (*action)(const T
 	if (!node) return;
 
 	inorderTraversalHelper(node->pLeft, action);
-	action(node->data);
+	action(node->data());
 	inorderTraversalHelper(node->pRight, action);
 }
 
@@ -344,7 +567,7 @@ void RedBlackTree<K, T>::printTreeStructure() const {
             q.push(nullptr);
         } else {
             // Print node data and color as tuple: (data, color)
-            cout << "(" << temp->data << ",";
+            cout << "(" << temp->data() << ",";
             if (temp->color == RED) {
                 cout << "R)";
             } else {
@@ -432,30 +655,43 @@ void RedBlackTree<K, T>::rotateLeft(RBTNode* node) {
 
 template <class K, class T>
 typename RedBlackTree<K, T>::RBTNode* RedBlackTree<K, T>::lowerBoundNode(const K& key) const {
+    RBTNode* res = nullptr;
     RBTNode* cur = this->root;
 
     while (cur) {
+        TREE_PREFETCH(cur->left);
+        TREE_PREFETCH(cur->right);
         if (cur->key >= key) {
-            return cur;
-		}
-        cur = cur->right;
-	}
+            res = cur;
+            cur = cur->left;
+        } else cur = cur->right;
+    }
 
-    return nullptr;
+    return res;
 }
 
 template <class K, class T>
 typename RedBlackTree<K, T>::RBTNode* RedBlackTree<K, T>::upperBoundNode(const K& key) const {
+    RBTNode* res = nullptr;
     RBTNode* cur = this->root;
 
     while (cur) {
+        TREE_PREFETCH(cur->left);
+        TREE_PREFETCH(cur->right);
         if (cur->key > key) {
-            return cur;
-		}
-        cur = cur->right;
+            res = cur;
+            cur = cur->left;
+        } else cur = cur->right;
     }
 
-    return nullptr;
+    return res;
+}
+
+template <class K, class T>
+typename RedBlackTree<K, T>::Iterator RedBlackTree<K, T>::begin() const {
+    RBTNode* cur = this->root;
+    while (cur && cur->left) cur = cur->left;
+    return Iterator(this, cur);
 }
 
 template <class K, class T>
@@ -482,17 +718,38 @@ int RedBlackTree<K, T>::size() const {
 }
 
 template <class K, class T>
-void RedBlackTree<K, T>::clearHelper(RBTNode* node) {
+typename RedBlackTree<K, T>::RBTNode* RedBlackTree<K, T>::createNode(const K& key, const T& value) {
+    void* block = allocator->allocate(sizeof(RBTNode));
+    return new (block) RBTNode(key, value, allocator);
+}
+
+template <class K, class T>
+void RedBlackTree<K, T>::destroyNode(RBTNode* node) {
+    node->payload.destroy(allocator, true);
+    node->~RBTNode();
+    allocator->deallocate(node, sizeof(RBTNode));
+}
+
+template <class K, class T>
+void RedBlackTree<K, T>::clearHelper(RBTNode* node, bool releaseStorage) {
 	if (!node) return;
 
-	clearHelper(node->left);
-	clearHelper(node->right);
-	delete node;
+	clearHelper(node->left, releaseStorage);
+	clearHelper(node->right, releaseStorage);
+	if (releaseStorage) destroyNode(node);
+	else {
+		node->payload.destroy(allocator, false);
+		node->~RBTNode();
+	}
 }
 
 template <class K, class T>
 void RedBlackTree<K, T>::clear() {
-	clearHelper(this->root);
+	if (ownsAllocator && allocator->supportsReleaseAll()) {
+		if (!is_trivially_destructible<K>::value || !is_trivially_destructible<T>::value) clearHelper(this->root, false);
+		allocator->releaseAll();
+	}
+	else clearHelper(this->root, true);
 	this->root = nullptr;
 }
 
@@ -564,7 +821,7 @@ void RedBlackTree<K, T>::fixInsert(RBTNode* node) {
 
 template <class K, class T>
 void RedBlackTree<K, T>::insert(const K& key, const T& value) {
-    RBTNode* newNode = new RBTNode(key, value);
+    RBTNode* newNode = createNode(key, value);
 
     if (!this->root) {
         newNode->color = BLACK;  // root always black
@@ -576,6 +833,8 @@ void RedBlackTree<K, T>::insert(const K& key, const T& value) {
     RBTNode* parent = nullptr;
 
     while (cur) {
+        TREE_PREFETCH(cur->left);
+        TREE_PREFETCH(cur->right);
         parent = cur;
         if (key < cur->key) cur = cur->left;
         else                cur = cur->right;
@@ -726,7 +985,7 @@ void RedBlackTree<K, T>::remove(const K& key) {
         
         // Swap data (not the nodes themselves)
         z->key = pred->key;
-        z->data = pred->data;
+        z->payload.swap(pred->payload);
         
         // Now delete the predecessor instead
         toDelete = pred;
@@ -759,7 +1018,7 @@ void RedBlackTree<K, T>::remove(const K& key) {
     }
     
     // Step 5: Delete the node
-    delete toDelete;
+    destroyNode(toDelete);
     
     // Step 6: Fix violations if we deleted a black node
     if (deletedColor == BLACK) {
@@ -778,6 +1037,8 @@ typename RedBlackTree<K, T>::RBTNode* RedBlackTree<K, T>::find(const K& key) con
 	
 	RBTNode* current = this->root;
 	while (current) {
+		TREE_PREFETCH(current->left);
+		TREE_PREFETCH(current->right);
 		if (current->key == key) return current;
 		else if (current->key < key) current = current->right;
 		else current = current->left;
@@ -792,6 +1053,8 @@ bool RedBlackTree<K, T>::contains(const K& key) const {
 	
 	RBTNode* current = this->root;
 	while (current) {
+		TREE_PREFETCH(current->left);
+		TREE_PREFETCH(current->right);
 		if (current->key == key) return true;
 		else if (current->key < key) current = current->right;
 		else current = current->left;
@@ -802,15 +1065,7 @@ bool RedBlackTree<K, T>::contains(const K& key) const {
 
 template <class K, class T>
 typename RedBlackTree<K, T>::RBTNode* RedBlackTree<K, T>::lowerBound(const K& key, bool& found) const{
-    RBTNode* res = nullptr;
-    RBTNode* cur = this->root;
-
-    while (cur) {
-        if (cur->key >= key) {
-            res = cur;
-            cur = cur->left;
-        } else cur = cur->right;
-    }
+    RBTNode* res = lowerBoundNode(key);
 
     if (res) {
         found = true;
@@ -820,15 +1075,7 @@ typename RedBlackTree<K, T>::RBTNode* RedBlackTree<K, T>::lowerBound(const K& ke
 
 template <class K, class T>
 typename RedBlackTree<K, T>::RBTNode* RedBlackTree<K, T>::upperBound(const K& key, bool& found) const{
-    RBTNode* res = nullptr;
-    RBTNode* cur = this->root;
-
-    while (cur) {
-        if (cur->key > key) {
-            res = cur;
-            cur = cur->left;
-        } else cur = cur->right;
-    }
+    RBTNode* res = upperBoundNode(key);
 
     if (res) {
         found = true;
@@ -837,604 +1084,3660 @@ typename RedBlackTree<K, T>::RBTNode* RedBlackTree<K, T>::upperBound(const K& ke
 }
 
 // =====================================
-// VectorRecord implementation
-// =====================================
-
-// Overload operator << for VectorRecord - prints only the id
-std::ostream& operator<<(std::ostream& os, const VectorRecord& record) {
-    os << record.id;
-    return os;
-}
-
-// =====================================
-// VectorStore implementation
+// BPlusTree<K, T> implementation
 // =====================================
-double VectorStore::distanceByMetric(const std::vector<float>& a, const std::vector<float>& b, const std::string& metric) const {
-    if (metric == "cosine") {
-        return cosineSimilarity(a, b);
-    } 
-    else if (metric == "euclidean") {
-        return l2Distance(a, b);
-    } 
-    else if (metric == "manhattan") {
-        return l1Distance(a, b);
-    } 
-    else {
-        throw invalid_argument("Invalid metric");
-    }
-}
+template <class K, class T>
+int BPlusTree<K, T>::subtreeSize(Node* node) {
+    if (node->isLeaf) return node->count;
 
-void VectorStore::rebuildTreeWithNewRoot(VectorRecord* newRoot) {
-    delete rootVector;
-    rootVector = new VectorRecord(*newRoot);
+    Inner* inner = static_cast<Inner*>(node);
+    int total = 0;
+    for (int i = 0; i <= inner->count; ++i) total += inner->sizes[i];
+    return total;
 }
 
-int VectorStore::size() {
-    return this->count;
+// Child whose range holds key: the number of separators <= key
+template <class K, class T>
+int BPlusTree<K, T>::childIndex(const Inner* node, const K& key) {
+    int i = 0;
+    while (i < node->count && !(key < node->keys[i])) ++i;
+    return i;
 }
 
-bool VectorStore::empty() {
-    return (this->count == 0 ? true : false);
-}
+template <class K, class T>
+typename BPlusTree<K, T>::Leaf* BPlusTree<K, T>::findLeaf(const K& key) const {
+    Node* node = this->root;
+    if (!node) return nullptr;
 
-void VectorStore::clear() {
-    this->vectorStore->clear();
-    this->normIndex->clear();
-    this->count = 0;
-    this->curId = 0;
-    this->averageDistance = 0.0;
-    delete this->rootVector;
-    this->rootVector = nullptr;
+    while (!node->isLeaf) {
+        Inner* inner = static_cast<Inner*>(node);
+        node = inner->children[childIndex(inner, key)];
+    }
+    return static_cast<Leaf*>(node);
 }
 
-std::vector<float>* VectorStore::preprocessing(std::string rawText) {
-	vector<float>* res = this->embeddingFunction(rawText);
-
-    if (res->size() > this->dimension) res->resize(this->dimension);
-    else if (res->size() < this->dimension) res->resize(this->dimension, 0.0f);
+template <class K, class T>
+void BPlusTree<K, T>::insert(const K& key, const T& value) {
+    if (!this->root) {
+        Leaf* leaf = createLeaf();
+        leaf->keys[0] = key;
+        leaf->values[0] = value;
+        leaf->count = 1;
+        this->root = head = tail = leaf;
+        this->entryCount = 1;
+        return;
+    }
 
-	return res;
+    K splitKey;
+    Node* splitNode = nullptr;
+    if (!insertHelper(this->root, key, value, splitKey, splitNode)) return;
+    ++this->entryCount;
+
+    // The root split: grow by one level
+    if (splitNode) {
+        Inner* newRoot = createInner();
+        newRoot->keys[0] = splitKey;
+        newRoot->children[0] = this->root;
+        newRoot->children[1] = splitNode;
+        newRoot->sizes[0] = subtreeSize(this->root);
+        newRoot->sizes[1] = subtreeSize(splitNode);
+        newRoot->count = 1;
+        this->root = newRoot;
+    }
 }
 
-void VectorStore::addText(std::string rawText) {
-    vector<float>* res = preprocessing(rawText);
+// Returns false if the key is already present. When node has to split, the
+// new right sibling and its lowest key come back through splitNode/splitKey.
+template <class K, class T>
+bool BPlusTree<K, T>::insertHelper(Node* node, const K& key, const T& value, K& splitKey, Node*& splitNode) {
+    splitNode = nullptr;
+
+    if (node->isLeaf) {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        int pos = (int)(std::lower_bound(leaf->keys, leaf->keys + leaf->count, key) - leaf->keys);
+        if (pos < leaf->count && leaf->keys[pos] == key) return false;
+
+        Leaf* target = leaf;
+        if (leaf->count == LEAF_CAPACITY) {
+            // Upper half moves to a new right sibling
+            Leaf* right = createLeaf();
+            int half = LEAF_CAPACITY / 2;
+            for (int i = half; i < leaf->count; ++i) {
+                right->keys[i - half] = leaf->keys[i];
+                right->values[i - half] = leaf->values[i];
+            }
+            right->count = leaf->count - half;
+            leaf->count = half;
+
+            right->next = leaf->next;
+            right->prev = leaf;
+            if (leaf->next) leaf->next->prev = right;
+            else tail = right;
+            leaf->next = right;
+
+            if (pos > half) {
+                target = right;
+                pos -= half;
+            }
+            splitNode = right;
+        }
 
-    double distance = l2Distance(*res, *referenceVector);
+        for (int i = target->count; i > pos; --i) {
+            target->keys[i] = target->keys[i - 1];
+            target->values[i] = target->values[i - 1];
+        }
+        target->keys[pos] = key;
+        target->values[pos] = value;
+        ++target->count;
 
-    double norm = 0.0;
-    for (float val : *res) {
-        norm += val * val;
+        if (splitNode) splitKey = static_cast<Leaf*>(splitNode)->keys[0];
+        return true;
     }
-    norm = sqrt(norm);
 
-    int maxId = 0;
-    if (count > 0) {
-        auto findMaxId = [&](const VectorRecord& rec) {
-            if (rec.id > maxId) {
-                maxId = rec.id;
-            }
-        };
-        vectorStore->inorder(findMaxId);
-    }
-    int newId = maxId + 1; 
+    Inner* inner = static_cast<Inner*>(node);
+    int index = childIndex(inner, key);
 
-    VectorRecord newRecord(newId, rawText, res, distance);
+    K childKey;
+    Node* childSplit = nullptr;
+    if (!insertHelper(inner->children[index], key, value, childKey, childSplit)) return false;
 
-    if (count == 0) {
-        rootVector = new VectorRecord(newRecord);
-        averageDistance = distance;
-        
-        vectorStore->insert(distance, newRecord);
-        normIndex->insert(norm, newRecord);
-        
-        count++;
-        return;
+    if (!childSplit) {
+        ++inner->sizes[index];
+        return true;
     }
 
-    averageDistance = ((averageDistance * count) + distance) / (count + 1);
-
-    vectorStore->insert(distance, newRecord);
-    normIndex->insert(norm, newRecord);
-    count++;
-
-    if (rootVector) {
-        double distNew = std::abs(distance - averageDistance);
-        double distRoot = std::abs(rootVector->distanceFromReference - averageDistance);
+    // Place the new child right after the one that split
+    K keys[INNER_CAPACITY + 1];
+    Node* children[INNER_CAPACITY + 2];
+    int sizes[INNER_CAPACITY + 2];
+    int count = inner->count + 1;
 
-        if (distNew < distRoot) {
-            rebuildTreeWithNewRoot(&newRecord);
+    for (int i = 0, j = 0; i < count; ++i) {
+        keys[i] = (i == index) ? childKey : inner->keys[j++];
+    }
+    for (int i = 0, j = 0; i <= count; ++i) {
+        if (i == index + 1) {
+            children[i] = childSplit;
+            sizes[i] = subtreeSize(childSplit);
+        } else {
+            children[i] = inner->children[j];
+            sizes[i] = (j == index) ? subtreeSize(inner->children[j]) : inner->sizes[j];
+            ++j;
         }
     }
-}
-
-VectorRecord* VectorStore::getVector(int index) {
-    if (index < 0 || index >= count) throw out_of_range("Index is invalid!");
 
-    VectorRecord* res = nullptr;
-    int currentIndex = 0;
-
-    auto action = [&](const VectorRecord& rec) {
-        if (currentIndex == index) {
-            res = const_cast<VectorRecord*>(&rec);
+    if (count <= INNER_CAPACITY) {
+        for (int i = 0; i < count; ++i) inner->keys[i] = keys[i];
+        for (int i = 0; i <= count; ++i) {
+            inner->children[i] = children[i];
+            inner->sizes[i] = sizes[i];
         }
-        ++currentIndex;
-    };
+        inner->count = count;
+        return true;
+    }
 
-    vectorStore->inorder(action);
+    // Overflow: the middle key moves up, the keys after it go right
+    int mid = count / 2;
+    Inner* right = createInner();
 
-    if (!res) throw out_of_range("Index is invalid!");
+    inner->count = mid;
+    for (int i = 0; i < mid; ++i) inner->keys[i] = keys[i];
+    for (int i = 0; i <= mid; ++i) {
+        inner->children[i] = children[i];
+        inner->sizes[i] = sizes[i];
+    }
 
-    return res;
-}
+    right->count = count - mid - 1;
+    for (int i = 0; i < right->count; ++i) right->keys[i] = keys[mid + 1 + i];
+    for (int i = 0; i <= right->count; ++i) {
+        right->children[i] = children[mid + 1 + i];
+        right->sizes[i] = sizes[mid + 1 + i];
+    }
 
-string VectorStore::getRawText(int index) {
-    if (index < 0 || index >= count) throw out_of_range("Index is invalid!");
-    VectorRecord* res = this->getVector(index);
-    return res->rawText;
+    splitKey = keys[mid];
+    splitNode = right;
+    return true;
 }
 
-int VectorStore::getId(int index) {
-    if (index < 0 || index >= count) throw out_of_range("Index is invalid!");
-    VectorRecord* res = this->getVector(index);
-    return res->id;
+template <class K, class T>
+void BPlusTree<K, T>::remove(const K& key) {
+    if (!this->root) return;
+    if (!removeHelper(this->root, key)) return;
+    --this->entryCount;
+
+    // Shrink from the top once the root is left with a single child
+    if (!this->root->isLeaf && this->root->count == 0) {
+        Inner* old = static_cast<Inner*>(this->root);
+        this->root = old->children[0];
+        destroyNode(old);
+    } else if (this->root->isLeaf && this->root->count == 0) {
+        destroyNode(this->root);
+        this->root = nullptr;
+        head = tail = nullptr;
+    }
 }
 
-bool VectorStore::removeAt(int index) {
-
-if (index < 0 || index >= count) throw out_of_range("Index is invalid!");    VectorRecord* removed = this->getVector(index);
-    double removedDist = removed->distanceFromReference;
-
-    double removedNorm = 0.0;
-    for (float val : *(removed->vector)) {
-        removedNorm += pow(val, 2);
+template <class K, class T>
+bool BPlusTree<K, T>::removeHelper(Node* node, const K& key) {
+    if (node->isLeaf) {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        int pos = (int)(std::lower_bound(leaf->keys, leaf->keys + leaf->count, key) - leaf->keys);
+        if (pos == leaf->count || !(leaf->keys[pos] == key)) return false;
+
+        for (int i = pos + 1; i < leaf->count; ++i) {
+            leaf->keys[i - 1] = leaf->keys[i];
+            leaf->values[i - 1] = leaf->values[i];
+        }
+        --leaf->count;
+        return true;
     }
-    removedNorm = sqrt(removedNorm);
 
-    vectorStore->remove(removedDist);
-    normIndex->remove(removedNorm);
+    Inner* inner = static_cast<Inner*>(node);
+    int index = childIndex(inner, key);
+    if (!removeHelper(inner->children[index], key)) return false;
 
-    bool wasRoot = (rootVector && removed->id == rootVector->id);
+    --inner->sizes[index];
 
-    delete removed->vector;
-
-    --this->count;
-    this->averageDistance = ((this->averageDistance * this->size()) - removedDist) / this->size();
+    Node* child = inner->children[index];
+    int minimum = child->isLeaf ? LEAF_MIN : INNER_MIN;
+    if (child->count < minimum) rebalanceChild(inner, index);
+    return true;
+}
 
-    if (wasRoot && count > 0) {
-        try {
-            VectorRecord* newRoot = getVector(0);
-            rebuildTreeWithNewRoot(newRoot);
-        } catch(...) {}
-    }
+// Tops up an underfull child from a sibling with keys to spare, or merges
+// it with one
+template <class K, class T>
+void BPlusTree<K, T>::rebalanceChild(Inner* parent, int index) {
+    Node* child = parent->children[index];
+    Node* left = index > 0 ? parent->children[index - 1] : nullptr;
+    Node* right = index < parent->count ? parent->children[index + 1] : nullptr;
+    int minimum = child->isLeaf ? LEAF_MIN : INNER_MIN;
+
+    if (left && left->count > minimum) {
+        if (child->isLeaf) {
+            Leaf* c = static_cast<Leaf*>(child);
+            Leaf* l = static_cast<Leaf*>(left);
+            for (int i = c->count; i > 0; --i) {
+                c->keys[i] = c->keys[i - 1];
+                c->values[i] = c->values[i - 1];
+            }
+            c->keys[0] = l->keys[l->count - 1];
+            c->values[0] = l->values[l->count - 1];
+            ++c->count;
+            --l->count;
+            parent->keys[index - 1] = c->keys[0];
+            --parent->sizes[index - 1];
+            ++parent->sizes[index];
+        } else {
+            Inner* c = static_cast<Inner*>(child);
+            Inner* l = static_cast<Inner*>(left);
+            for (int i = c->count; i > 0; --i) c->keys[i] = c->keys[i - 1];
+            for (int i = c->count + 1; i > 0; --i) {
+                c->children[i] = c->children[i - 1];
+                c->sizes[i] = c->sizes[i - 1];
+            }
+            c->keys[0] = parent->keys[index - 1];
+            c->children[0] = l->children[l->count];
+            c->sizes[0] = l->sizes[l->count];
+            ++c->count;
+
+            parent->keys[index - 1] = l->keys[l->count - 1];
+            --l->count;
+            parent->sizes[index - 1] -= c->sizes[0];
+            parent->sizes[index] += c->sizes[0];
+        }
+        return;
+    }
+
+    if (right && right->count > minimum) {
+        if (child->isLeaf) {
+            Leaf* c = static_cast<Leaf*>(child);
+            Leaf* r = static_cast<Leaf*>(right);
+            c->keys[c->count] = r->keys[0];
+            c->values[c->count] = r->values[0];
+            ++c->count;
+            for (int i = 1; i < r->count; ++i) {
+                r->keys[i - 1] = r->keys[i];
+                r->values[i - 1] = r->values[i];
+            }
+            --r->count;
+            parent->keys[index] = r->keys[0];
+            ++parent->sizes[index];
+            --parent->sizes[index + 1];
+        } else {
+            Inner* c = static_cast<Inner*>(child);
+            Inner* r = static_cast<Inner*>(right);
+            int moved = r->sizes[0];
+            c->keys[c->count] = parent->keys[index];
+            c->children[c->count + 1] = r->children[0];
+            c->sizes[c->count + 1] = moved;
+            ++c->count;
+
+            parent->keys[index] = r->keys[0];
+            for (int i = 1; i < r->count; ++i) r->keys[i - 1] = r->keys[i];
+            for (int i = 1; i <= r->count; ++i) {
+                r->children[i - 1] = r->children[i];
+                r->sizes[i - 1] = r->sizes[i];
+            }
+            --r->count;
+            parent->sizes[index] += moved;
+            parent->sizes[index + 1] -= moved;
+        }
+        return;
+    }
+
+    if (left) mergeChildren(parent, index - 1);
+    else if (right) mergeChildren(parent, index);
+}
+
+// Folds children[index + 1] into children[index] and drops the separator
+template <class K, class T>
+void BPlusTree<K, T>::mergeChildren(Inner* parent, int index) {
+    Node* leftNode = parent->children[index];
+    Node* rightNode = parent->children[index + 1];
+
+    if (leftNode->isLeaf) {
+        Leaf* l = static_cast<Leaf*>(leftNode);
+        Leaf* r = static_cast<Leaf*>(rightNode);
+        for (int i = 0; i < r->count; ++i) {
+            l->keys[l->count + i] = r->keys[i];
+            l->values[l->count + i] = r->values[i];
+        }
+        l->count += r->count;
+
+        l->next = r->next;
+        if (r->next) r->next->prev = l;
+        else tail = l;
+        destroyNode(r);
+    } else {
+        Inner* l = static_cast<Inner*>(leftNode);
+        Inner* r = static_cast<Inner*>(rightNode);
+        l->keys[l->count] = parent->keys[index];
+        for (int i = 0; i < r->count; ++i) l->keys[l->count + 1 + i] = r->keys[i];
+        for (int i = 0; i <= r->count; ++i) {
+            l->children[l->count + 1 + i] = r->children[i];
+            l->sizes[l->count + 1 + i] = r->sizes[i];
+        }
+        l->count += r->count + 1;
+        destroyNode(r);
+    }
+
+    parent->sizes[index] += parent->sizes[index + 1];
+    for (int i = index + 1; i < parent->count; ++i) parent->keys[i - 1] = parent->keys[i];
+    for (int i = index + 2; i <= parent->count; ++i) {
+        parent->children[i - 1] = parent->children[i];
+        parent->sizes[i - 1] = parent->sizes[i];
+    }
+    --parent->count;
+}
+
+template <class K, class T>
+bool BPlusTree<K, T>::contains(const K& key) const {
+    Leaf* leaf = findLeaf(key);
+    if (!leaf) return false;
+
+    int pos = (int)(std::lower_bound(leaf->keys, leaf->keys + leaf->count, key) - leaf->keys);
+    return pos < leaf->count && leaf->keys[pos] == key;
+}
+
+template <class K, class T>
+typename BPlusTree<K, T>::Iterator BPlusTree<K, T>::select(int index) const {
+    if (index < 0 || index >= this->entryCount) return end();
+
+    Node* node = this->root;
+    while (!node->isLeaf) {
+        Inner* inner = static_cast<Inner*>(node);
+        int i = 0;
+        while (index >= inner->sizes[i]) index -= inner->sizes[i++];
+        node = inner->children[i];
+    }
+    return Iterator(this, static_cast<Leaf*>(node), index);
+}
+
+template <class K, class T>
+int BPlusTree<K, T>::rank(const K& key) const {
+    Node* node = this->root;
+    if (!node) return 0;
+
+    int res = 0;
+    while (!node->isLeaf) {
+        Inner* inner = static_cast<Inner*>(node);
+        int child = childIndex(inner, key);
+        for (int i = 0; i < child; ++i) res += inner->sizes[i];
+        node = inner->children[child];
+    }
+
+    Leaf* leaf = static_cast<Leaf*>(node);
+    return res + (int)(std::lower_bound(leaf->keys, leaf->keys + leaf->count, key) - leaf->keys);
+}
+
+template <class K, class T>
+typename BPlusTree<K, T>::Iterator BPlusTree<K, T>::lowerBound(const K& key) const {
+    Leaf* leaf = findLeaf(key);
+    if (!leaf) return end();
+
+    int pos = (int)(std::lower_bound(leaf->keys, leaf->keys + leaf->count, key) - leaf->keys);
+    if (pos == leaf->count) return Iterator(this, leaf->next, 0);
+    return Iterator(this, leaf, pos);
+}
+
+template <class K, class T>
+typename BPlusTree<K, T>::Iterator BPlusTree<K, T>::upperBound(const K& key) const {
+    Leaf* leaf = findLeaf(key);
+    if (!leaf) return end();
+
+    int pos = (int)(std::upper_bound(leaf->keys, leaf->keys + leaf->count, key) - leaf->keys);
+    if (pos == leaf->count) return Iterator(this, leaf->next, 0);
+    return Iterator(this, leaf, pos);
+}
+
+template <class K, class T>
+typename BPlusTree<K, T>::Iterator BPlusTree<K, T>::floor(const K& key) const {
+    Iterator it = upperBound(key);
+    if (it == begin()) return end();
+    return --it;
+}
+
+template <class K, class T>
+int BPlusTree<K, T>::getHeight() const {
+    int height = 0;
+    for (Node* node = this->root; node; ++height) {
+        if (node->isLeaf) node = nullptr;
+        else node = static_cast<Inner*>(node)->children[0];
+    }
+    return height;
+}
+
+template <class K, class T>
+typename BPlusTree<K, T>::Leaf* BPlusTree<K, T>::createLeaf() {
+    return new (allocator->allocate(sizeof(Leaf))) Leaf();
+}
+
+template <class K, class T>
+typename BPlusTree<K, T>::Inner* BPlusTree<K, T>::createInner() {
+    return new (allocator->allocate(sizeof(Inner))) Inner();
+}
+
+template <class K, class T>
+void BPlusTree<K, T>::destroyNode(Node* node) {
+    if (node->isLeaf) {
+        static_cast<Leaf*>(node)->~Leaf();
+        allocator->deallocate(node, sizeof(Leaf));
+    } else {
+        static_cast<Inner*>(node)->~Inner();
+        allocator->deallocate(node, sizeof(Inner));
+    }
+}
+
+// With releaseStorage == false only the destructors run; the caller hands
+// the storage back to the allocator in bulk afterwards
+template <class K, class T>
+void BPlusTree<K, T>::clearHelper(Node* node, bool releaseStorage) {
+    if (!node->isLeaf) {
+        Inner* inner = static_cast<Inner*>(node);
+        for (int i = 0; i <= inner->count; ++i) clearHelper(inner->children[i], releaseStorage);
+    }
+
+    if (releaseStorage) destroyNode(node);
+    else if (node->isLeaf) static_cast<Leaf*>(node)->~Leaf();
+    else static_cast<Inner*>(node)->~Inner();
+}
+
+template <class K, class T>
+void BPlusTree<K, T>::clear() {
+    if (ownsAllocator && allocator->supportsReleaseAll()) {
+        if (this->root && (!is_trivially_destructible<K>::value || !is_trivially_destructible<T>::value)) clearHelper(this->root, false);
+        allocator->releaseAll();
+    }
+    else if (this->root) clearHelper(this->root, true);
+    this->root = nullptr;
+    head = tail = nullptr;
+    this->entryCount = 0;
+}
+
+// =====================================
+// EytzingerIndex<K, T> implementation
+// =====================================
+
+// In-order walk of the implicit tree hands out the sorted positions
+template <class K, class T>
+void EytzingerIndex<K, T>::place(int node, int& next) {
+    if (node >= (int)layout.size()) return;
+
+    place(2 * node, next);
+    layout[node] = keys[next];
+    rankAt[node] = next++;
+    place(2 * node + 1, next);
+}
+
+// A descent ends below the answer after one left turn and then only right
+// turns: drop those trailing 1 bits and the final 0
+template <class K, class T>
+int EytzingerIndex<K, T>::resolve(unsigned node) {
+#if defined(__GNUC__)
+    return (int)(node >> __builtin_ffs(~node));
+#else
+    while (node & 1) node >>= 1;
+    return (int)(node >> 1);
+#endif
+}
+
+template <class K, class T>
+void EytzingerIndex<K, T>::clear() {
+    layout.clear();
+    rankAt.clear();
+    keys.clear();
+    values.clear();
+}
+
+template <class K, class T>
+int EytzingerIndex<K, T>::lowerBound(const K& key) const {
+    unsigned n = (unsigned)keys.size();
+    unsigned node = 1;
+    while (node <= n) {
+        node = 2 * node + (layout[node] < key);
+    }
+
+    int found = resolve(node);
+    return found ? rankAt[found] : (int)n;
+}
+
+template <class K, class T>
+int EytzingerIndex<K, T>::upperBound(const K& key) const {
+    unsigned n = (unsigned)keys.size();
+    unsigned node = 1;
+    while (node <= n) {
+        node = 2 * node + !(key < layout[node]);
+    }
+
+    int found = resolve(node);
+    return found ? rankAt[found] : (int)n;
+}
+
+// =====================================
+// Distance kernels
+// =====================================
+// Each kernel set works on raw float spans and widens to double before
+// any arithmetic, like the scalar loops always did: distances are used as
+// tree keys, so they must not lose precision to float accumulation. The
+// best set for the running CPU is picked once, on first use.
+
+static inline void cosinePartsScalar(const float* a, const float* b, size_t n, double& dot, double& normA, double& normB) {
+    dot = normA = normB = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        dot += (double)a[i] * b[i];
+        normA += (double)a[i] * a[i];
+        normB += (double)b[i] * b[i];
+    }
+}
+
+static inline double dotScalar(const float* a, const float* b, size_t n) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        sum += (double)a[i] * b[i];
+    }
+    return sum;
+}
+
+static inline double l1Scalar(const float* a, const float* b, size_t n) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        sum += fabs((double)a[i] - b[i]);
+    }
+    return sum;
+}
+
+static inline double squaredL2Scalar(const float* a, const float* b, size_t n) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        double diff = (double)a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VECTORSTORE_X86_KERNELS
+
+// ---------- SSE2 (2 doubles per lane group) ----------
+__attribute__((target("sse2")))
+static inline double hsumSSE(__m128d v) {
+    double lanes[2];
+    _mm_storeu_pd(lanes, v);
+    return lanes[0] + lanes[1];
+}
+
+__attribute__((target("sse2")))
+static inline void cosinePartsSSE(const float* a, const float* b, size_t n, double& dot, double& normA, double& normB) {
+    __m128d d = _mm_setzero_pd(), na = _mm_setzero_pd(), nb = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 fa = _mm_loadu_ps(a + i);
+        __m128 fb = _mm_loadu_ps(b + i);
+        __m128d a0 = _mm_cvtps_pd(fa), a1 = _mm_cvtps_pd(_mm_movehl_ps(fa, fa));
+        __m128d b0 = _mm_cvtps_pd(fb), b1 = _mm_cvtps_pd(_mm_movehl_ps(fb, fb));
+        d = _mm_add_pd(d, _mm_add_pd(_mm_mul_pd(a0, b0), _mm_mul_pd(a1, b1)));
+        na = _mm_add_pd(na, _mm_add_pd(_mm_mul_pd(a0, a0), _mm_mul_pd(a1, a1)));
+        nb = _mm_add_pd(nb, _mm_add_pd(_mm_mul_pd(b0, b0), _mm_mul_pd(b1, b1)));
+    }
+    cosinePartsScalar(a + i, b + i, n - i, dot, normA, normB);
+    dot += hsumSSE(d);
+    normA += hsumSSE(na);
+    normB += hsumSSE(nb);
+}
+
+__attribute__((target("sse2")))
+static inline double dotSSE(const float* a, const float* b, size_t n) {
+    __m128d d = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 fa = _mm_loadu_ps(a + i);
+        __m128 fb = _mm_loadu_ps(b + i);
+        __m128d a0 = _mm_cvtps_pd(fa), a1 = _mm_cvtps_pd(_mm_movehl_ps(fa, fa));
+        __m128d b0 = _mm_cvtps_pd(fb), b1 = _mm_cvtps_pd(_mm_movehl_ps(fb, fb));
+        d = _mm_add_pd(d, _mm_add_pd(_mm_mul_pd(a0, b0), _mm_mul_pd(a1, b1)));
+    }
+    return dotScalar(a + i, b + i, n - i) + hsumSSE(d);
+}
+
+__attribute__((target("sse2")))
+static inline double l1SSE(const float* a, const float* b, size_t n) {
+    const __m128d absMask = _mm_castsi128_pd(_mm_set1_epi64x(0x7fffffffffffffffLL));
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 fa = _mm_loadu_ps(a + i);
+        __m128 fb = _mm_loadu_ps(b + i);
+        __m128d d0 = _mm_sub_pd(_mm_cvtps_pd(fa), _mm_cvtps_pd(fb));
+        __m128d d1 = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(fa, fa)), _mm_cvtps_pd(_mm_movehl_ps(fb, fb)));
+        s0 = _mm_add_pd(s0, _mm_and_pd(absMask, d0));
+        s1 = _mm_add_pd(s1, _mm_and_pd(absMask, d1));
+    }
+    return hsumSSE(_mm_add_pd(s0, s1)) + l1Scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static inline double squaredL2SSE(const float* a, const float* b, size_t n) {
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 fa = _mm_loadu_ps(a + i);
+        __m128 fb = _mm_loadu_ps(b + i);
+        __m128d d0 = _mm_sub_pd(_mm_cvtps_pd(fa), _mm_cvtps_pd(fb));
+        __m128d d1 = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(fa, fa)), _mm_cvtps_pd(_mm_movehl_ps(fb, fb)));
+        s0 = _mm_add_pd(s0, _mm_mul_pd(d0, d0));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(d1, d1));
+    }
+    return hsumSSE(_mm_add_pd(s0, s1)) + squaredL2Scalar(a + i, b + i, n - i);
+}
+
+// ---------- AVX2 + FMA (4 doubles per lane group) ----------
+__attribute__((target("avx2,fma")))
+static inline double hsumAVX(__m256d v) {
+    double lanes[4];
+    _mm256_storeu_pd(lanes, v);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+__attribute__((target("avx2,fma")))
+static inline void cosinePartsAVX2(const float* a, const float* b, size_t n, double& dot, double& normA, double& normB) {
+    __m256d d = _mm256_setzero_pd(), na = _mm256_setzero_pd(), nb = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 fa = _mm256_loadu_ps(a + i);
+        __m256 fb = _mm256_loadu_ps(b + i);
+        __m256d a0 = _mm256_cvtps_pd(_mm256_castps256_ps128(fa)), a1 = _mm256_cvtps_pd(_mm256_extractf128_ps(fa, 1));
+        __m256d b0 = _mm256_cvtps_pd(_mm256_castps256_ps128(fb)), b1 = _mm256_cvtps_pd(_mm256_extractf128_ps(fb, 1));
+        d = _mm256_fmadd_pd(a1, b1, _mm256_fmadd_pd(a0, b0, d));
+        na = _mm256_fmadd_pd(a1, a1, _mm256_fmadd_pd(a0, a0, na));
+        nb = _mm256_fmadd_pd(b1, b1, _mm256_fmadd_pd(b0, b0, nb));
+    }
+    cosinePartsScalar(a + i, b + i, n - i, dot, normA, normB);
+    dot += hsumAVX(d);
+    normA += hsumAVX(na);
+    normB += hsumAVX(nb);
+}
+
+__attribute__((target("avx2,fma")))
+static inline double dotAVX2(const float* a, const float* b, size_t n) {
+    __m256d d = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 fa = _mm256_loadu_ps(a + i);
+        __m256 fb = _mm256_loadu_ps(b + i);
+        __m256d a0 = _mm256_cvtps_pd(_mm256_castps256_ps128(fa)), a1 = _mm256_cvtps_pd(_mm256_extractf128_ps(fa, 1));
+        __m256d b0 = _mm256_cvtps_pd(_mm256_castps256_ps128(fb)), b1 = _mm256_cvtps_pd(_mm256_extractf128_ps(fb, 1));
+        d = _mm256_fmadd_pd(a1, b1, _mm256_fmadd_pd(a0, b0, d));
+    }
+    return dotScalar(a + i, b + i, n - i) + hsumAVX(d);
+}
+
+__attribute__((target("avx2,fma")))
+static inline double l1AVX2(const float* a, const float* b, size_t n) {
+    const __m256d absMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 fa = _mm256_loadu_ps(a + i);
+        __m256 fb = _mm256_loadu_ps(b + i);
+        __m256d d0 = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(fa)), _mm256_cvtps_pd(_mm256_castps256_ps128(fb)));
+        __m256d d1 = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(fa, 1)), _mm256_cvtps_pd(_mm256_extractf128_ps(fb, 1)));
+        s0 = _mm256_add_pd(s0, _mm256_and_pd(absMask, d0));
+        s1 = _mm256_add_pd(s1, _mm256_and_pd(absMask, d1));
+    }
+    return hsumAVX(_mm256_add_pd(s0, s1)) + l1Scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static inline double squaredL2AVX2(const float* a, const float* b, size_t n) {
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 fa = _mm256_loadu_ps(a + i);
+        __m256 fb = _mm256_loadu_ps(b + i);
+        __m256d d0 = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(fa)), _mm256_cvtps_pd(_mm256_castps256_ps128(fb)));
+        __m256d d1 = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(fa, 1)), _mm256_cvtps_pd(_mm256_extractf128_ps(fb, 1)));
+        s0 = _mm256_fmadd_pd(d0, d0, s0);
+        s1 = _mm256_fmadd_pd(d1, d1, s1);
+    }
+    return hsumAVX(_mm256_add_pd(s0, s1)) + squaredL2Scalar(a + i, b + i, n - i);
+}
+
+// ---------- AVX-512 (8 doubles per lane group) ----------
+// 8 floats per step, widened to 8 doubles; the tail is zero-padded
+__attribute__((target("avx512f")))
+static inline __m512d loadWidenAVX512(const float* p, size_t remaining) {
+    if (remaining >= 8) return _mm512_maskz_cvtps_pd(0xff, _mm256_loadu_ps(p));
+
+    float tail[8] = { 0.0f };
+    for (size_t i = 0; i < remaining; ++i) tail[i] = p[i];
+    return _mm512_maskz_cvtps_pd(0xff, _mm256_loadu_ps(tail));
+}
+
+__attribute__((target("avx512f")))
+static inline double hsumAVX512(__m512d v) {
+    double lanes[8];
+    _mm512_storeu_pd(lanes, v);
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+__attribute__((target("avx512f")))
+static inline void cosinePartsAVX512(const float* a, const float* b, size_t n, double& dot, double& normA, double& normB) {
+    __m512d d = _mm512_setzero_pd(), na = _mm512_setzero_pd(), nb = _mm512_setzero_pd();
+    for (size_t i = 0; i < n; i += 8) {
+        __m512d va = loadWidenAVX512(a + i, n - i);
+        __m512d vb = loadWidenAVX512(b + i, n - i);
+        d = _mm512_fmadd_pd(va, vb, d);
+        na = _mm512_fmadd_pd(va, va, na);
+        nb = _mm512_fmadd_pd(vb, vb, nb);
+    }
+    dot = hsumAVX512(d);
+    normA = hsumAVX512(na);
+    normB = hsumAVX512(nb);
+}
+
+__attribute__((target("avx512f")))
+static inline double dotAVX512(const float* a, const float* b, size_t n) {
+    __m512d d = _mm512_setzero_pd();
+    for (size_t i = 0; i < n; i += 8) {
+        d = _mm512_fmadd_pd(loadWidenAVX512(a + i, n - i), loadWidenAVX512(b + i, n - i), d);
+    }
+    return hsumAVX512(d);
+}
+
+__attribute__((target("avx512f")))
+static inline double l1AVX512(const float* a, const float* b, size_t n) {
+    __m512d s = _mm512_setzero_pd();
+    for (size_t i = 0; i < n; i += 8) {
+        __m512d diff = _mm512_sub_pd(loadWidenAVX512(a + i, n - i), loadWidenAVX512(b + i, n - i));
+        s = _mm512_add_pd(s, _mm512_abs_pd(diff));
+    }
+    return hsumAVX512(s);
+}
+
+__attribute__((target("avx512f")))
+static inline double squaredL2AVX512(const float* a, const float* b, size_t n) {
+    __m512d s = _mm512_setzero_pd();
+    for (size_t i = 0; i < n; i += 8) {
+        __m512d diff = _mm512_sub_pd(loadWidenAVX512(a + i, n - i), loadWidenAVX512(b + i, n - i));
+        s = _mm512_fmadd_pd(diff, diff, s);
+    }
+    return hsumAVX512(s);
+}
+#endif
+
+vector<DistanceKernels> supportedDistanceKernels() {
+    vector<DistanceKernels> sets;
+    sets.push_back({ "scalar", cosinePartsScalar, dotScalar, l1Scalar, squaredL2Scalar });
+#ifdef VECTORSTORE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        sets.push_back({ "sse2", cosinePartsSSE, dotSSE, l1SSE, squaredL2SSE });
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        sets.push_back({ "avx2", cosinePartsAVX2, dotAVX2, l1AVX2, squaredL2AVX2 });
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        sets.push_back({ "avx512", cosinePartsAVX512, dotAVX512, l1AVX512, squaredL2AVX512 });
+    }
+#endif
+    return sets;
+}
+
+// The widest supported set
+const DistanceKernels& distanceKernels() {
+    static const DistanceKernels kernels = supportedDistanceKernels().back();
+    return kernels;
+}
+
+// Fixed-length wrappers for FixedVectorStore<Dim>: the length argument is
+// ignored in favour of N, so once the kernel is inlined into the wrapper
+// every loop bound is a compile-time constant.
+template <size_t N>
+static void cosinePartsScalarN(const float* a, const float* b, size_t, double& dot, double& normA, double& normB) {
+    cosinePartsScalar(a, b, N, dot, normA, normB);
+}
+template <size_t N>
+static double dotScalarN(const float* a, const float* b, size_t) { return dotScalar(a, b, N); }
+template <size_t N>
+static double l1ScalarN(const float* a, const float* b, size_t) { return l1Scalar(a, b, N); }
+template <size_t N>
+static double squaredL2ScalarN(const float* a, const float* b, size_t) { return squaredL2Scalar(a, b, N); }
+
+#ifdef VECTORSTORE_X86_KERNELS
+template <size_t N> __attribute__((target("sse2")))
+static void cosinePartsSSEN(const float* a, const float* b, size_t, double& dot, double& normA, double& normB) {
+    cosinePartsSSE(a, b, N, dot, normA, normB);
+}
+template <size_t N> __attribute__((target("sse2")))
+static double dotSSEN(const float* a, const float* b, size_t) { return dotSSE(a, b, N); }
+template <size_t N> __attribute__((target("sse2")))
+static double l1SSEN(const float* a, const float* b, size_t) { return l1SSE(a, b, N); }
+template <size_t N> __attribute__((target("sse2")))
+static double squaredL2SSEN(const float* a, const float* b, size_t) { return squaredL2SSE(a, b, N); }
+
+template <size_t N> __attribute__((target("avx2,fma")))
+static void cosinePartsAVX2N(const float* a, const float* b, size_t, double& dot, double& normA, double& normB) {
+    cosinePartsAVX2(a, b, N, dot, normA, normB);
+}
+template <size_t N> __attribute__((target("avx2,fma")))
+static double dotAVX2N(const float* a, const float* b, size_t) { return dotAVX2(a, b, N); }
+template <size_t N> __attribute__((target("avx2,fma")))
+static double l1AVX2N(const float* a, const float* b, size_t) { return l1AVX2(a, b, N); }
+template <size_t N> __attribute__((target("avx2,fma")))
+static double squaredL2AVX2N(const float* a, const float* b, size_t) { return squaredL2AVX2(a, b, N); }
+
+template <size_t N> __attribute__((target("avx512f")))
+static void cosinePartsAVX512N(const float* a, const float* b, size_t, double& dot, double& normA, double& normB) {
+    cosinePartsAVX512(a, b, N, dot, normA, normB);
+}
+template <size_t N> __attribute__((target("avx512f")))
+static double dotAVX512N(const float* a, const float* b, size_t) { return dotAVX512(a, b, N); }
+template <size_t N> __attribute__((target("avx512f")))
+static double l1AVX512N(const float* a, const float* b, size_t) { return l1AVX512(a, b, N); }
+template <size_t N> __attribute__((target("avx512f")))
+static double squaredL2AVX512N(const float* a, const float* b, size_t) { return squaredL2AVX512(a, b, N); }
+#endif
+
+template <size_t N>
+static DistanceKernels selectFixedDistanceKernels() {
+#ifdef VECTORSTORE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return { "avx512", cosinePartsAVX512N<N>, dotAVX512N<N>, l1AVX512N<N>, squaredL2AVX512N<N> };
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return { "avx2", cosinePartsAVX2N<N>, dotAVX2N<N>, l1AVX2N<N>, squaredL2AVX2N<N> };
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return { "sse2", cosinePartsSSEN<N>, dotSSEN<N>, l1SSEN<N>, squaredL2SSEN<N> };
+    }
+#endif
+    return { "scalar", cosinePartsScalarN<N>, dotScalarN<N>, l1ScalarN<N>, squaredL2ScalarN<N> };
+}
+
+template <size_t N>
+static const DistanceKernels& fixedDistanceKernels() {
+    static const DistanceKernels kernels = selectFixedDistanceKernels<N>();
+    return kernels;
+}
+
+// Per-metric scoring and ordering, resolved at compile time by the query
+// templates. For cosine a higher score is better; for the distances lower.
+template <DistanceMetric M> struct MetricTraits;
+
+template <> struct MetricTraits<COSINE> {
+    static const DistanceMetric METRIC = COSINE;
+    static double score(const DistanceKernels& k, const float* a, const float* b, size_t n) {
+        double dot, normA, normB;
+        k.cosineParts(a, b, n, dot, normA, normB);
+        return dot / (sqrt(normA) * sqrt(normB));
+    }
+    // With both norms known up front only the dot product is left
+    static double score(const DistanceKernels& k, const float* a, const float* b, size_t n, double normA, double normB) {
+        return k.dot(a, b, n) / (normA * normB);
+    }
+    static bool better(double a, double b) { return a > b; }
+    static bool within(double score, double radius) { return score >= radius; }
+    static double worst() { return -1.0; }
+};
+
+template <> struct MetricTraits<EUCLIDEAN> {
+    static const DistanceMetric METRIC = EUCLIDEAN;
+    static double score(const DistanceKernels& k, const float* a, const float* b, size_t n) {
+        return sqrt(k.squaredL2(a, b, n));
+    }
+    static double score(const DistanceKernels& k, const float* a, const float* b, size_t n, double, double) {
+        return score(k, a, b, n);
+    }
+    static bool better(double a, double b) { return a < b; }
+    static bool within(double score, double radius) { return score <= radius; }
+    static double worst() { return numeric_limits<double>::max(); }
+};
+
+template <> struct MetricTraits<MANHATTAN> {
+    static const DistanceMetric METRIC = MANHATTAN;
+    static double score(const DistanceKernels& k, const float* a, const float* b, size_t n) {
+        return k.l1(a, b, n);
+    }
+    static double score(const DistanceKernels& k, const float* a, const float* b, size_t n, double, double) {
+        return score(k, a, b, n);
+    }
+    static bool better(double a, double b) { return a < b; }
+    static bool within(double score, double radius) { return score <= radius; }
+    static double worst() { return numeric_limits<double>::max(); }
+};
+
+// Norm of the first n query components, only needed for cosine
+template <DistanceMetric M>
+static inline double queryNorm(const DistanceKernels& k, const float* query, size_t n) {
+    return (M == COSINE) ? sqrt(k.dot(query, query, n)) : 0.0;
+}
+
+// Scores a query against an arena row. The stored row norm covers the
+// whole row, so it replaces the kernel's only when the query does too.
+template <DistanceMetric M>
+static inline double scoreRow(const DistanceKernels& k, const float* query, double normQ, size_t n,
+                              const VectorArena& arena, int slot) {
+    if (n == (size_t)arena.getDimension()) {
+        return MetricTraits<M>::score(k, query, arena.row(slot), n, normQ, arena.norm(slot));
+    }
+    return MetricTraits<M>::score(k, query, arena.row(slot), n);
+}
+
+// =====================================
+// VectorArena implementation
+// =====================================
+VectorArena::VectorArena(int dimension)
+    : dimension(dimension), capacity(0), used(0), liveCount(0), rows(nullptr), holdReleased(false), generation(0) {
+    const int perLine = ALIGNMENT / sizeof(float);
+    stride = (dimension + perLine - 1) / perLine * perLine;
+    if (stride == 0) stride = perLine;
+}
+
+void VectorArena::grow(int minCapacity) {
+    int newCapacity = capacity ? capacity * 2 : 64;
+    if (newCapacity < minCapacity) newCapacity = minCapacity;
+    reallocate(newCapacity);
+}
+
+// A view sharing the old block keeps it alive; otherwise it is freed here
+void VectorArena::reallocate(int newCapacity) {
+    void* raw = ::operator new((size_t)newCapacity * stride * sizeof(float) + ALIGNMENT);
+    std::shared_ptr<void> newBlock(raw, [](void* p) { ::operator delete(p); });
+    uintptr_t addr = reinterpret_cast<uintptr_t>(raw);
+    float* newRows = reinterpret_cast<float*>((addr + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1));
+
+    if (used > 0) {
+        copy(rows, rows + (size_t)used * stride, newRows);
+    }
+
+    block = std::move(newBlock);
+    rows = newRows;
+    capacity = newCapacity;
+}
+
+int VectorArena::allocate(int owner, const float* values, size_t count) {
+    int slot;
+    if (!freeSlots.empty()) {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+    } else {
+        if (used == capacity) grow(used + 1);
+        slot = used++;
+        owners.push_back(-1);
+        norms.push_back(0.0);
+    }
+
+    float* dst = row(slot);
+    size_t n = min(count, (size_t)dimension);
+    copy(values, values + n, dst);
+    fill(dst + n, dst + stride, 0.0f);
+
+    owners[slot] = owner;
+    refreshNorm(slot);
+    ++liveCount;
+    return slot;
+}
+
+void VectorArena::release(int slot) {
+    if (slot < 0 || slot >= used || owners[slot] < 0) return;
+
+    owners[slot] = -1;
+    if (holdReleased) heldSlots.push_back(slot);
+    else freeSlots.push_back(slot);
+    --liveCount;
+}
+
+void VectorArena::clear() {
+    block.reset();
+    rows = nullptr;
+    capacity = used = liveCount = 0;
+    owners.clear();
+    norms.clear();
+    freeSlots.clear();
+    heldSlots.clear();
+    ++generation;
+}
+
+// The view gets no spare capacity, so a row it allocated would go to a
+// block of its own rather than into one the source may write
+void VectorArena::shareFrom(const VectorArena& other) {
+    clear();
+    block = other.block;
+    rows = other.rows;
+    capacity = used = other.used;
+    liveCount = other.liveCount;
+    owners = other.owners;
+    norms = other.norms;
+}
+
+void VectorArena::unshare() {
+    if (block && block.use_count() > 1) reallocate(capacity);
+}
+
+void VectorArena::setHoldReleased(bool hold) {
+    holdReleased = hold;
+    if (!hold) {
+        freeSlots.insert(freeSlots.end(), heldSlots.begin(), heldSlots.end());
+        heldSlots.clear();
+    }
+}
+
+vector<int> VectorArena::takeHeld() {
+    vector<int> slots;
+    slots.swap(heldSlots);
+    return slots;
+}
+
+void VectorArena::recycle(const vector<int>& slots, int takenGeneration) {
+    if (takenGeneration != generation) return;
+    freeSlots.insert(freeSlots.end(), slots.begin(), slots.end());
+}
+
+// Same kernel as the cosine path, so a stored norm matches what
+// cosineParts would have produced for the row
+double VectorArena::refreshNorm(int slot) {
+    const float* r = row(slot);
+    norms[slot] = sqrt(distanceKernels().dot(r, r, dimension));
+    return norms[slot];
+}
+
+vector<int> VectorArena::compact() {
+    unshare();
+    vector<int> remap(used, -1);
+
+    int next = 0;
+    for (int slot = 0; slot < used; ++slot) {
+        if (owners[slot] < 0) continue;
+        if (slot != next) {
+            copy(row(slot), row(slot) + stride, row(next));
+            owners[next] = owners[slot];
+            norms[next] = norms[slot];
+        }
+        remap[slot] = next++;
+    }
+
+    used = next;
+    owners.resize(used);
+    norms.resize(used);
+    freeSlots.clear();
+    heldSlots.clear();
+    ++generation;
+    return remap;
+}
+
+// =====================================
+// IdIndex implementation
+// =====================================
+IdIndex::IdIndex() : mask(0), entryCount(0) {}
+
+// Fibonacci hashing: the top bits of id * 2^64 / phi
+size_t IdIndex::home(int id) const {
+    uint64_t h = (uint64_t)(uint32_t)id * 11400714819323198485ull;
+    return (size_t)(h >> 32) & mask;
+}
+
+void IdIndex::rehash(size_t capacity) {
+    vector<Entry> old;
+    old.swap(table);
+
+    table.assign(capacity, Entry{EMPTY, 0});
+    mask = capacity - 1;
+
+    for (const Entry& entry : old) {
+        if (entry.id == EMPTY) continue;
+        size_t i = home(entry.id);
+        while (table[i].id != EMPTY) i = (i + 1) & mask;
+        table[i] = entry;
+    }
+}
+
+void IdIndex::insert(int id, int slot) {
+    if ((size_t)(entryCount + 1) * 2 > table.size()) {
+        rehash(table.empty() ? 16 : table.size() * 2);
+    }
+
+    size_t i = home(id);
+    while (table[i].id != EMPTY) {
+        if (table[i].id == id) {
+            table[i].slot = slot;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+
+    table[i].id = id;
+    table[i].slot = slot;
+    ++entryCount;
+}
+
+bool IdIndex::erase(int id) {
+    if (table.empty()) return false;
+
+    size_t i = home(id);
+    while (table[i].id != id) {
+        if (table[i].id == EMPTY) return false;
+        i = (i + 1) & mask;
+    }
+
+    // Pull back every later entry of the run that may sit at the hole
+    size_t hole = i;
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & mask;
+        if (table[j].id == EMPTY) break;
+
+        size_t want = home(table[j].id);
+        bool movable = (hole <= j) ? (want <= hole || want > j) : (want <= hole && want > j);
+        if (movable) {
+            table[hole] = table[j];
+            hole = j;
+        }
+    }
+    table[hole].id = EMPTY;
+    --entryCount;
+    return true;
+}
+
+int IdIndex::find(int id) const {
+    if (table.empty()) return -1;
+
+    size_t i = home(id);
+    while (table[i].id != EMPTY) {
+        if (table[i].id == id) return table[i].slot;
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+void IdIndex::clear() {
+    table.clear();
+    mask = 0;
+    entryCount = 0;
+}
+
+// =====================================
+// ThreadPool implementation
+// =====================================
+ThreadPool::ThreadPool(int threads)
+    : job(nullptr), taskCount(0), nextTask(0), pending(0), generation(0), stopping(false) {
+    for (int i = 1; i < threads; ++i) {
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) worker.join();
+}
+
+void ThreadPool::workerLoop() {
+    unsigned seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping) return;
+
+        seen = generation;
+        runTasks(lock);
+    }
+}
+
+// Claims tasks of the current job until none are left; called with the
+// lock held, which is dropped while a task runs
+void ThreadPool::runTasks(std::unique_lock<std::mutex>& lock) {
+    while (nextTask < taskCount) {
+        int task = nextTask++;
+        lock.unlock();
+        (*job)(task);
+        lock.lock();
+        if (--pending == 0) done.notify_all();
+    }
+}
+
+void ThreadPool::parallelFor(int tasks, const std::function<void(int)>& body) {
+    std::unique_lock<std::mutex> submit(submitMutex, std::try_to_lock);
+    if (workers.empty() || tasks <= 1 || !submit.owns_lock()) {
+        for (int task = 0; task < tasks; ++task) body(task);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    job = &body;
+    taskCount = tasks;
+    nextTask = 0;
+    pending = tasks;
+    ++generation;
+    wake.notify_all();
+
+    runTasks(lock);
+    done.wait(lock, [&] { return pending == 0; });
+    job = nullptr;
+    taskCount = 0;
+}
+
+// =====================================
+// WorkStealingScheduler implementation
+// =====================================
+// The scheduler and worker index of the running thread; set for workers
+// and for the thread inside run()
+static thread_local WorkStealingScheduler* currentScheduler = nullptr;
+static thread_local int currentWorker = -1;
+
+WorkStealingScheduler::WorkStealingScheduler(int threads) : active(false), stopping(false) {
+    int count = max(1, threads);
+    for (int i = 0; i < count; ++i) queues.emplace_back();
+    for (int i = 1; i < count; ++i) {
+        workers.emplace_back(&WorkStealingScheduler::workerLoop, this, i);
+    }
+}
+
+WorkStealingScheduler::~WorkStealingScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) worker.join();
+}
+
+// Workers sleep between jobs and poll for work while one is running
+void WorkStealingScheduler::workerLoop(int index) {
+    currentScheduler = this;
+    currentWorker = index;
+    unsigned seed = 2654435761u * (unsigned)index;
+
+    while (!stopping) {
+        if (!active) {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || active; });
+            continue;
+        }
+        if (!runOne(index, seed)) std::this_thread::yield();
+    }
+}
+
+bool WorkStealingScheduler::runOne(int index, unsigned& seed) {
+    Task task;
+    bool found = false;
+    {
+        WorkerQueue& own = queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            found = true;
+        }
+    }
+
+    int count = (int)queues.size();
+    if (!found && count > 1) {
+        // xorshift; the victim is any worker but this one
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        int victim = (int)(seed % (unsigned)(count - 1));
+        if (victim >= index) ++victim;
+
+        WorkerQueue& other = queues[victim];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if (!other.tasks.empty()) {
+            task = std::move(other.tasks.front());
+            other.tasks.pop_front();
+            found = true;
+        }
+    }
+    if (!found) return false;
+
+    task.fn();
+    --task.group->pending;
+    return true;
+}
+
+void WorkStealingScheduler::run(const std::function<void()>& job) {
+    std::unique_lock<std::mutex> submit(submitMutex, std::try_to_lock);
+    if (!submit.owns_lock() || currentScheduler == this) {
+        job();
+        return;
+    }
+
+    WorkStealingScheduler* outerScheduler = currentScheduler;
+    int outerWorker = currentWorker;
+    currentScheduler = this;
+    currentWorker = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        active = true;
+    }
+    wake.notify_all();
+
+    job();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        active = false;
+    }
+    currentScheduler = outerScheduler;
+    currentWorker = outerWorker;
+}
+
+void WorkStealingScheduler::spawn(TaskGroup& group, std::function<void()> task) {
+    if (currentScheduler != this) {
+        task();
+        return;
+    }
+
+    ++group.pending;
+    WorkerQueue& own = queues[currentWorker];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    own.tasks.push_back(Task{std::move(task), &group});
+}
+
+void WorkStealingScheduler::wait(TaskGroup& group) {
+    if (currentScheduler != this) return;
+
+    unsigned seed = 2654435761u * (unsigned)(currentWorker + 1);
+    while (group.pending > 0) {
+        if (!runOne(currentWorker, seed)) std::this_thread::yield();
+    }
+}
+
+// =====================================
+// EpochReclaimer implementation
+// =====================================
+// Epoch 0 marks a free reader slot, so counting starts at 1
+EpochReclaimer::EpochReclaimer() : globalEpoch(1) {
+    for (ReaderSlot& reader : readers) reader.epoch.store(0);
+}
+
+EpochReclaimer::~EpochReclaimer() {
+    synchronize();
+}
+
+// A reader that read the epoch just before collect() advanced it is
+// still counted from the older epoch, which only delays freeing
+int EpochReclaimer::enter() {
+    uint64_t epoch = globalEpoch.load();
+    int slot = (int)(hash<std::thread::id>()(std::this_thread::get_id()) % MAX_READERS);
+
+    for (int tried = 0;; slot = (slot + 1) % MAX_READERS) {
+        uint64_t expected = 0;
+        if (readers[slot].epoch.compare_exchange_strong(expected, epoch)) return slot;
+        if (++tried % MAX_READERS == 0) std::this_thread::yield();
+    }
+}
+
+void EpochReclaimer::leave(int slot) {
+    readers[slot].epoch.store(0);
+}
+
+uint64_t EpochReclaimer::oldestReader() const {
+    uint64_t oldest = numeric_limits<uint64_t>::max();
+    for (const ReaderSlot& reader : readers) {
+        uint64_t epoch = reader.epoch.load();
+        if (epoch != 0 && epoch < oldest) oldest = epoch;
+    }
+    return oldest;
+}
+
+void EpochReclaimer::retire(std::function<void()> release) {
+    retired.push_back(Retired{globalEpoch.load(), std::move(release)});
+}
+
+void EpochReclaimer::collect() {
+    globalEpoch.fetch_add(1);
+    uint64_t oldest = oldestReader();
+
+    // Retire epochs never decrease, so the freeable entries are a prefix
+    size_t done = 0;
+    while (done < retired.size() && retired[done].epoch < oldest) {
+        retired[done++].release();
+    }
+    retired.erase(retired.begin(), retired.begin() + done);
+}
+
+void EpochReclaimer::synchronize() {
+    uint64_t epoch = globalEpoch.fetch_add(1);
+    while (oldestReader() <= epoch) std::this_thread::yield();
+
+    for (Retired& entry : retired) entry.release();
+    retired.clear();
+}
+
+// =====================================
+// VectorRecord implementation
+// =====================================
+
+// Overload operator << for VectorRecord - prints only the id
+std::ostream& operator<<(std::ostream& os, const VectorRecord& record) {
+    os << record.id;
+    return os;
+}
+
+// =====================================
+// RecordTable implementation
+// =====================================
+// Snapshots are freed on the writing thread, so a count of one cannot rise
+// again behind its back
+VectorRecord& RecordTable::edit(int slot) {
+    std::shared_ptr<VectorRecord>& record = slots[slot];
+    if (record.use_count() > 1) record = std::make_shared<VectorRecord>(*record);
+    return *record;
+}
+
+// =====================================
+// VectorStore implementation
+// =====================================
+DistanceMetric VectorStore::parseMetric(const std::string& metric) {
+    string name = metric;
+    for (char& c : name) c = tolower((unsigned char)c);
+
+    if (name == "cosine") return COSINE;
+    if (name == "euclidean") return EUCLIDEAN;
+    if (name == "manhattan") return MANHATTAN;
+    throw invalid_metric();
+}
+
+double VectorStore::distanceByMetric(const std::vector<float>& a, const std::vector<float>& b, DistanceMetric metric) const {
+    switch (metric) {
+        case COSINE:    return cosineSimilarity(a, b);
+        case EUCLIDEAN: return l2Distance(a, b);
+        case MANHATTAN: return l1Distance(a, b);
+    }
+    throw invalid_metric();
+}
+
+void VectorStore::rebuildTreeWithNewRoot(VectorRecord* newRoot) {
+    rootSlot = newRoot ? newRoot->slot : -1;
+}
+
+// Stored by the arena when the row is written, so insertion and removal
+// always agree on the normIndex key
+double VectorStore::normOf(int slot) const {
+    return vectors->norm(slot);
+}
+
+// Number of records whose distance key is below key
+int VectorStore::rankOf(const IndexKey& key) const {
+    int rank = 0;
+    withDistanceIndex([&](auto& index) { rank = index.rank(key); });
+    return rank;
+}
+
+// ---------- Concurrent reads ----------
+thread_local const VectorStore::ReadGuard* VectorStore::ReadGuard::innermost = nullptr;
+
+VectorStore::ReadGuard::ReadGuard(const VectorStore& store)
+    : store(store), view(nullptr), slot(-1), locked(false), enclosed(false), outer(innermost) {
+    std::thread::id self = std::this_thread::get_id();
+    if (!store.epochs || store.lockHolder.load() == self) return;
+
+    // An enclosing guard on this thread already pinned a snapshot
+    for (const ReadGuard* guard = outer; guard; guard = guard->outer) {
+        if (&guard->store == &store) {
+            view = guard->view;
+            enclosed = true;
+            return;
+        }
+    }
+
+    // The writing thread reads the live store, so it sees its own changes
+    if (store.writer.load() == self) {
+        store.writeMutex.lock();
+        store.lockHolder.store(self);
+        locked = true;
+        return;
+    }
+
+    slot = store.epochs->enter();
+    view = store.published.load();
+    innermost = this;
+}
+
+VectorStore::ReadGuard::~ReadGuard() {
+    if (locked) {
+        store.lockHolder.store(std::thread::id());
+        store.writeMutex.unlock();
+    }
+    if (slot < 0) return;
+    innermost = outer;
+    store.epochs->leave(slot);
+}
+
+// The guard inside the call ends with it, which would unpin the snapshot
+// under the pointer being returned
+VectorStore* VectorStore::ReadGuard::pinnedSnapshot() const {
+    if (view && !enclosed) {
+        throw logic_error("Hold a ReadGuard while using records from a concurrent store");
+    }
+    return view;
+}
+
+VectorStore::WriteGuard::WriteGuard(VectorStore& store)
+    : store(store), locked(false), outermost(false) {
+    if (!store.epochs) return;
+
+    std::thread::id self = std::this_thread::get_id();
+    if (store.lockHolder.load() != self) {
+        store.writeMutex.lock();
+        store.lockHolder.store(self);
+        locked = true;
+    }
+    outermost = !store.writing;
+    store.writing = true;
+}
+
+VectorStore::WriteGuard::~WriteGuard() {
+    if (outermost) {
+        // Scaling with the size keeps the copying O(1) per change on average
+        int interval = store.publishInterval ? store.publishInterval : max(1, store.count / 64);
+        if (++store.unpublishedWrites >= interval) store.publishSnapshot();
+
+        store.writer.store(std::this_thread::get_id());
+        store.writing = false;
+    }
+    if (locked) {
+        store.lockHolder.store(std::thread::id());
+        store.writeMutex.unlock();
+    }
+}
+
+// The rows are shared, so the cost is O(n) in the records, not O(n * dim)
+VectorStore* VectorStore::snapshot() const {
+    VectorStore* view = new VectorStore(dimension, embeddingFunction, *referenceVector,
+                                        distanceTree ? BPLUS_INDEX : AVL_INDEX);
+    view->vectors->shareFrom(*vectors);
+    view->records = records;
+    view->idIndex = idIndex;
+    view->rootSlot = rootSlot;
+    view->count = count;
+    view->curId = curId;
+    view->averageDistance = averageDistance;
+
+    // Both indexes are read back in key order, so the rebuilds are O(n)
+    vector<pair<IndexKey, int>> entries;
+    entries.reserve(count);
+    withDistanceIndex([&](auto& index) {
+        for (auto it = index.begin(); it != index.end(); ++it) {
+            entries.push_back({it.key(), *it});
+        }
+    });
+    view->withDistanceIndex([&](auto& index) { index.buildFromSorted(entries.begin(), entries.end()); });
+
+    entries.clear();
+    for (RedBlackTree<IndexKey, int>::Iterator it = normIndex->begin(); it != normIndex->end(); ++it) {
+        entries.push_back({it.key(), *it});
+    }
+    view->normIndex->buildFromSorted(entries.begin(), entries.end());
+
+    if (frozen) view->freeze();
+    return view;
+}
+
+// Readers that loaded the old snapshot entered no later than this epoch,
+// so it stays alive until the last of them leaves
+void VectorStore::publishSnapshot() {
+    retireSnapshot(published.exchange(snapshot()));
+    epochs->collect();
+    unpublishedWrites = 0;
+}
+
+// Snapshots are freed oldest first, so once old goes no snapshot that
+// saw the held slots live is left
+void VectorStore::retireSnapshot(VectorStore* old) {
+    vector<int> held = vectors->takeHeld();
+    int generation = vectors->getGeneration();
+    VectorArena* arena = vectors;
+    epochs->retire([old, held, generation, arena] {
+        delete old;
+        arena->recycle(held, generation);
+    });
+}
+
+void VectorStore::enableConcurrentReads(int interval) {
+    if (interval < 0) throw invalid_argument("Invalid publish interval");
+
+    if (epochs) {
+        std::unique_lock<std::mutex> lock(writeMutex, std::defer_lock);
+        if (lockHolder.load() != std::this_thread::get_id()) lock.lock();
+        publishInterval = interval;
+        return;
+    }
+    publishInterval = interval;
+    vectors->setHoldReleased(true);
+    epochs = new EpochReclaimer();
+    publishSnapshot();
+}
+
+void VectorStore::disableConcurrentReads() {
+    if (!epochs) return;
+
+    retireSnapshot(published.exchange(nullptr));
+    delete epochs;
+    epochs = nullptr;
+    vectors->setHoldReleased(false);
+    writer.store(std::thread::id());
+}
+
+void VectorStore::publish() {
+    if (!epochs) return;
+
+    // The writing thread may already hold the lock through a guard
+    std::unique_lock<std::mutex> lock(writeMutex, std::defer_lock);
+    if (lockHolder.load() != std::this_thread::get_id()) lock.lock();
+    if (unpublishedWrites > 0) publishSnapshot();
+}
+
+int VectorStore::size() {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->size();
+
+    return this->count;
+}
+
+bool VectorStore::empty() {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->empty();
+
+    return (this->count == 0 ? true : false);
+}
+
+void VectorStore::clear() {
+    WriteGuard guard(*this);
+    this->thaw();
+    withDistanceIndex([](auto& index) { index.clear(); });
+    this->normIndex->clear();
+    this->vectors->clear();
+    this->records.clear();
+    this->idIndex.clear();
+    this->count = 0;
+    this->curId = 1;
+    this->averageDistance = 0.0;
+    this->rootSlot = -1;
+}
+
+std::vector<float>* VectorStore::preprocessing(std::string rawText) {
+	vector<float>* res = this->embeddingFunction(rawText);
+
+    if (res->size() > this->dimension) res->resize(this->dimension);
+    else if (res->size() < this->dimension) res->resize(this->dimension, 0.0f);
+
+	return res;
+}
+
+void VectorStore::addText(std::string rawText) {
+    WriteGuard guard(*this);
+    insertText(rawText, curId++);
+}
+
+// Adds rawText under newId, which must not be in use
+void VectorStore::insertText(const std::string& rawText, int newId) {
+    thaw();
+    if (newId >= curId) curId = newId + 1;
+
+    vector<float>* res = preprocessing(rawText);
+
+    double distance = l2Distance(*res, *referenceVector);
+
+    int slot = vectors->allocate(newId, res->data(), res->size());
+    delete res;
+    idIndex.insert(newId, slot);
+
+    if (slot >= records.size()) records.resize(slot + 1);
+    VectorRecord newRecord(newId, rawText, nullptr, distance);
+    newRecord.slot = slot;
+    records.assign(slot, std::move(newRecord));
+
+    double norm = normOf(slot);
+
+    if (count == 0) {
+        rootSlot = slot;
+        averageDistance = distance;
+        
+        withDistanceIndex([&](auto& index) { index.insert(IndexKey(distance, newId), slot); });
+        normIndex->insert(IndexKey(norm, newId), slot);
+        
+        count++;
+        return;
+    }
+
+    averageDistance = ((averageDistance * count) + distance) / (count + 1);
+
+    withDistanceIndex([&](auto& index) { index.insert(IndexKey(distance, newId), slot); });
+    normIndex->insert(IndexKey(norm, newId), slot);
+    count++;
+
+    if (rootSlot >= 0) {
+        double distNew = std::abs(distance - averageDistance);
+        double distRoot = std::abs(records[rootSlot].distanceFromReference - averageDistance);
+
+        if (distNew < distRoot) {
+            rebuildTreeWithNewRoot(&records[slot]);
+        }
+    }
+}
+
+VectorRecord* VectorStore::getVector(int index) {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.pinnedSnapshot()) return view->getVector(index);
+
+    return &records[slotAt(index)];
+}
+
+int VectorStore::slotAt(int index) const {
+    if (index < 0 || index >= count) throw out_of_range("Index is invalid!");
+
+    if (distanceTree) {
+        BPlusTree<IndexKey, int>::Iterator it = distanceTree->select(index);
+        if (it == distanceTree->end()) throw out_of_range("Index is invalid!");
+        return *it;
+    }
+    AVLTree<IndexKey, int>::AVLNode* node = vectorStore->select(index);
+    if (!node) throw out_of_range("Index is invalid!");
+    return node->data();
+}
+
+string VectorStore::getRawText(int index) {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->getRawText(index);
+
+    if (index < 0 || index >= count) throw out_of_range("Index is invalid!");
+    VectorRecord* res = this->getVector(index);
+    return res->rawText;
+}
+
+int VectorStore::getId(int index) {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->getId(index);
+
+    if (index < 0 || index >= count) throw out_of_range("Index is invalid!");
+    VectorRecord* res = this->getVector(index);
+    return res->id;
+}
+
+bool VectorStore::removeAt(int index) {
+    WriteGuard guard(*this);
+    if (index < 0 || index >= count) throw out_of_range("Index is invalid!");
+
+    removeSlot(this->getVector(index)->slot);
+    return true;
+}
+
+VectorRecord* VectorStore::getById(int id) {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.pinnedSnapshot()) return view->getById(id);
+
+    int slot = idIndex.find(id);
+    if (slot < 0) return nullptr;
+    return &records[slot];
+}
+
+bool VectorStore::removeById(int id) {
+    WriteGuard guard(*this);
+    int slot = idIndex.find(id);
+    if (slot < 0) return false;
+
+    removeSlot(slot);
+    return true;
+}
+
+bool VectorStore::containsId(int id) const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->containsId(id);
+
+    return idIndex.contains(id);
+}
+
+// Drops the record in slot from every index and the arena
+void VectorStore::removeSlot(int removedSlot) {
+    thaw();
+
+    const VectorRecord& removed = records[removedSlot];
+    double removedDist = removed.distanceFromReference;
+    int removedId = removed.id;
+
+    withDistanceIndex([&](auto& index) { index.remove(IndexKey(removedDist, removedId)); });
+    normIndex->remove(IndexKey(normOf(removedSlot), removedId));
+    idIndex.erase(removedId);
+
+    bool wasRoot = (removedSlot == rootSlot);
+
+    vectors->release(removedSlot);
+    records.release(removedSlot);
+
+    --this->count;
+    if (count > 0) this->averageDistance = ((this->averageDistance * this->size()) - removedDist) / this->size();
+    else this->averageDistance = 0.0;
+
+    // The record now first in distance order takes over
+    if (wasRoot && count > 0) {
+        rebuildTreeWithNewRoot(getVector(0));
+    }
+
+    if (count == 0) {
+        rootSlot = -1;
+    }
+}
+
+void VectorStore::compactVectors() {
+    WriteGuard guard(*this);
+    if (vectors->freeCount() == 0) return;
+    thaw();
+
+    vector<int> remap = vectors->compact();
+
+    // Live slots only move down, so the records can be shifted in place
+    for (size_t slot = 0; slot < remap.size(); ++slot) {
+        if (remap[slot] < 0 || remap[slot] == (int)slot) continue;
+        records.move(slot, remap[slot]);
+        records.edit(remap[slot]).slot = remap[slot];
+        idIndex.insert(records[remap[slot]].id, remap[slot]);
+    }
+    records.resize(vectors->slotCount());
+
+    withDistanceIndex([&](auto& index) {
+        for (auto it = index.begin(); it != index.end(); ++it) {
+            *it = remap[*it];
+        }
+    });
+    for (RedBlackTree<IndexKey, int>::Iterator it = normIndex->begin(); it != normIndex->end(); ++it) {
+        *it = remap[*it];
+    }
+    if (rootSlot >= 0) {
+        rootSlot = remap[rootSlot];
+    }
+}
+
+void VectorStore::freeze() {
+    WriteGuard guard(*this);
+    vector<pair<IndexKey, int>> entries;
+    entries.reserve(count);
+
+    withDistanceIndex([&](auto& index) {
+        for (auto it = index.begin(); it != index.end(); ++it) {
+            entries.push_back({it.key(), *it});
+        }
+    });
+    frozenDistance->build(entries.begin(), entries.end());
+
+    entries.clear();
+    for (RedBlackTree<IndexKey, int>::Iterator it = normIndex->begin(); it != normIndex->end(); ++it) {
+        entries.push_back({it.key(), *it});
+    }
+    frozenNorm->build(entries.begin(), entries.end());
+
+    frozen = true;
+}
+
+void VectorStore::thaw() {
+    WriteGuard guard(*this);
+    if (!frozen) return;
+
+    frozenDistance->clear();
+    frozenNorm->clear();
+    frozen = false;
+}
+
+bool VectorStore::isFrozen() const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->isFrozen();
+
+    return frozen;
+}
+
+void VectorStore::setWorkerCount(int workers) {
+    WriteGuard guard(*this);
+    if (workers <= 0) workers = max(1, (int)std::thread::hardware_concurrency());
+    if (workers == getWorkerCount()) return;
+
+    delete pool;
+    delete scheduler;
+    pool = (workers > 1) ? new ThreadPool(workers) : nullptr;
+    scheduler = (workers > 1) ? new WorkStealingScheduler(workers) : nullptr;
+}
+
+int VectorStore::getWorkerCount() const {
+    return pool ? pool->size() : 1;
+}
+
+// Scans shorter than this many slots per chunk stay on one thread
+static const int PARALLEL_MIN_SLOTS = 4096;
+
+// Per-chunk results joined in chunk order
+static vector<int> concatChunks(const vector<vector<int>>& parts) {
+    size_t total = 0;
+    for (const vector<int>& part : parts) total += part.size();
+
+    vector<int> joined;
+    joined.reserve(total);
+    for (const vector<int>& part : parts) joined.insert(joined.end(), part.begin(), part.end());
+    return joined;
+}
+
+// k-way merge of runs each sorted by better; keeps the first k entries
+template <typename Better>
+static vector<pair<double, int>> mergeSortedRuns(const vector<vector<pair<double, int>>>& runs, int k, Better better) {
+    typedef pair<pair<double, int>, int> Head;     // entry, run it came from
+    auto worseHead = [&](const Head& a, const Head& b) { return better(b.first, a.first); };
+    priority_queue<Head, vector<Head>, decltype(worseHead)> heads(worseHead);
+    vector<size_t> next(runs.size(), 0);
+    for (int run = 0; run < (int)runs.size(); ++run) {
+        if (!runs[run].empty()) heads.push({runs[run][0], run});
+    }
+
+    vector<pair<double, int>> merged;
+    merged.reserve(k);
+    while ((int)merged.size() < k && !heads.empty()) {
+        Head head = heads.top();
+        heads.pop();
+        merged.push_back(head.first);
+
+        int run = head.second;
+        if (++next[run] < runs[run].size()) heads.push({runs[run][next[run]], run});
+    }
+    return merged;
+}
+
+// A few chunks per worker, so one slow chunk does not hold up the rest
+int VectorStore::chunkCount(int items, int minChunk) const {
+    if (!pool) return 1;
+    int chunks = min(pool->size() * 4, items / max(1, minChunk));
+    return max(1, chunks);
+}
+
+// Runs a and b, as two tasks when there is a scheduler
+template <typename A, typename B>
+static void parallelInvoke(WorkStealingScheduler* scheduler, A a, B b) {
+    if (!scheduler) {
+        a();
+        b();
+        return;
+    }
+
+    WorkStealingScheduler::TaskGroup group;
+    scheduler->spawn(group, a);
+    b();
+    scheduler->wait(group);
+}
+
+// Calls f(i) for i in [begin, end), halving the range into tasks down to grain
+template <typename Func>
+static void parallelRange(WorkStealingScheduler* scheduler, int begin, int end, int grain, Func& f) {
+    if (!scheduler || end - begin <= grain) {
+        for (int i = begin; i < end; ++i) f(i);
+        return;
+    }
+
+    int mid = begin + (end - begin) / 2;
+    parallelInvoke(scheduler,
+        [&] { parallelRange(scheduler, begin, mid, grain, f); },
+        [&] { parallelRange(scheduler, mid, end, grain, f); });
+}
+
+// Merge sort with the halves sorted as separate tasks. For a strict total
+// order the result is the one std::sort gives.
+template <typename Iter, typename Cmp>
+static void parallelSort(WorkStealingScheduler* scheduler, Iter begin, Iter end, Cmp cmp) {
+    if (!scheduler || end - begin <= PARALLEL_BUILD_GRAIN) {
+        sort(begin, end, cmp);
+        return;
+    }
+
+    Iter mid = begin + (end - begin) / 2;
+    parallelInvoke(scheduler,
+        [&] { parallelSort(scheduler, begin, mid, cmp); },
+        [&] { parallelSort(scheduler, mid, end, cmp); });
+    inplace_merge(begin, mid, end, cmp);
+}
+
+template <typename Body>
+void VectorStore::forEachChunk(int items, int chunks, Body body) const {
+    auto run = [&](int chunk) {
+        int begin = (int)((long long)items * chunk / chunks);
+        int end = (int)((long long)items * (chunk + 1) / chunks);
+        body(chunk, begin, end);
+    };
+
+    if (pool && chunks > 1) {
+        pool->parallelFor(chunks, run);
+    } else {
+        for (int chunk = 0; chunk < chunks; ++chunk) run(chunk);
+    }
+}
+
+const float* VectorStore::getVectorData(const VectorRecord* record) const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.pinnedSnapshot()) return view->getVectorData(record);
+
+    if (!record) return nullptr;
+    if (record->slot >= 0) return vectors->row(record->slot);
+    return record->vector ? record->vector->data() : nullptr;
+}
+
+void VectorStore::setReferenceVector(const std::vector<float>& newReference) {
+    WriteGuard guard(*this);
+    thaw();
+    *referenceVector = newReference;
+
+    if (scheduler) scheduler->run([&] { rebuildIndexes(); });
+    else rebuildIndexes();
+}
+
+// Recomputes every distance to the reference and rebuilds both indexes.
+// With a scheduler the distances, the two sorts and the two builds are
+// split into tasks; the keys are unique, so the result is the same.
+void VectorStore::rebuildIndexes() {
+    const DistanceKernels& kernels = distanceKernels();
+    size_t n = min(referenceVector->size(), (size_t)dimension);
+
+    auto recompute = [&](int slot) {
+        if (!records.holds(slot)) return;
+        VectorRecord& r = records.edit(slot);
+        r.distanceFromReference = MetricTraits<EUCLIDEAN>::score(kernels, vectors->row(r.slot), referenceVector->data(), n);
+    };
+    parallelRange(scheduler, 0, records.size(), PARALLEL_MIN_SLOTS, recompute);
+
+    vector<pair<IndexKey, int>> byDistance;
+    vector<pair<IndexKey, int>> byNorm;
+    byDistance.reserve(count);
+    byNorm.reserve(count);
+
+    double totalDist = 0.0;
+    for (int slot = 0; slot < records.size(); ++slot) {
+        if (!records.holds(slot)) continue;
+
+        const VectorRecord& r = records[slot];
+        totalDist += r.distanceFromReference;
+        byDistance.push_back({IndexKey(r.distanceFromReference, r.id), r.slot});
+        byNorm.push_back({IndexKey(normOf(r.slot), r.id), r.slot});
+    }
+
+    if (byDistance.empty()) {
+        withDistanceIndex([](auto& index) { index.clear(); });
+        normIndex->clear();
+        return;
+    }
+
+    // Sort once per key and rebuild both indexes bottom-up
+    auto byKey = [](const pair<IndexKey, int>& a, const pair<IndexKey, int>& b) {
+        return a.first < b.first;
+    };
+    parallelInvoke(scheduler,
+        [&] {
+            parallelSort(scheduler, byDistance.begin(), byDistance.end(), byKey);
+            withDistanceIndex([&](auto& index) { index.buildFromSorted(byDistance.begin(), byDistance.end(), scheduler); });
+        },
+        [&] {
+            parallelSort(scheduler, byNorm.begin(), byNorm.end(), byKey);
+            normIndex->buildFromSorted(byNorm.begin(), byNorm.end(), scheduler);
+        });
+
+    this->averageDistance = totalDist / count;
+
+    rootSlot = -1;
+    double minDiff = numeric_limits<double>::max();
+
+    for (const pair<IndexKey, int>& entry : byDistance) {
+        double diff = abs(entry.first.value - this->averageDistance);
+        if (diff < minDiff) {
+            minDiff = diff;
+            rootSlot = entry.second;
+        }
+    }
+}
+
+vector<float>* VectorStore::getReferenceVector() const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.pinnedSnapshot()) return view->getReferenceVector();
+
+    return this->referenceVector;
+}
+
+VectorRecord* VectorStore::getRootVector() const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.pinnedSnapshot()) return view->getRootVector();
+
+    if (rootSlot < 0) return nullptr;
+    return const_cast<VectorRecord*>(&records[rootSlot]);
+}
+
+double VectorStore::getAverageDistance() const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->getAverageDistance();
+
+    return this->averageDistance;
+}
+
+void VectorStore::setEmbeddingFunction(std::vector<float>* (*newEmbeddingFunction)(const std::string&)) {
+    WriteGuard guard(*this);
+    this->embeddingFunction = newEmbeddingFunction; 
+}
+
+void VectorStore::forEach(void (*action)(vector<float>&, int, std::string&)) {
+    WriteGuard guard(*this);
+    // Rows may change norm, which moves them in normIndex
+    thaw();
+    // Rows are rewritten in place, out from under any snapshot sharing them
+    vectors->unshare();
+
+    // The callback edits a copy of the row, written back afterwards
+    vector<float> scratch;
+    auto visit = [&](const int& slot)->void {
+        VectorRecord& record = records.edit(slot);
+        float* row = vectors->row(slot);
+        scratch.assign(row, row + dimension);
+
+        action(scratch, record.id, const_cast<std::string&>(record.rawText));
+
+        size_t n = min(scratch.size(), (size_t)dimension);
+        copy(scratch.begin(), scratch.begin() + n, row);
+        fill(row + n, row + dimension, 0.0f);
+
+        double oldNorm = vectors->norm(slot);
+        double newNorm = vectors->refreshNorm(slot);
+        if (newNorm != oldNorm) {
+            normIndex->remove(IndexKey(oldNorm, record.id));
+            normIndex->insert(IndexKey(newNorm, record.id), slot);
+        }
+    };
+    withDistanceIndex([&](auto& index) { index.inorder(visit); });
+}
+
+std::vector<int> VectorStore::getAllIdsSortedByDistance() const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->getAllIdsSortedByDistance();
+
+	std::vector<int> idVec;
+
+	auto action = [&](const int& slot) {
+		idVec.push_back(records[slot].id);
+	};
+
+	withDistanceIndex([&](auto& index) { index.inorder(action); });
+	return idVec;
+}
+
+std::vector<VectorRecord*> VectorStore::getAllVectorsSortedByDistance() const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.pinnedSnapshot()) return view->getAllVectorsSortedByDistance();
+
+    std::vector<VectorRecord*> rVec;
+
+    auto action = [&](const int& slot) {
+        rVec.push_back(const_cast<VectorRecord*>(&records[slot]));
+    };
+    withDistanceIndex([&](auto& index) { index.inorder(action); });
+    return rVec;
+}	
+
+double VectorStore::cosineSimilarity(const vector<float>& v1, const vector<float>& v2) const {
+    double dotProduct, normV1, normV2;
+    distanceKernels().cosineParts(v1.data(), v2.data(), min(v1.size(), v2.size()), dotProduct, normV1, normV2);
+
+    return dotProduct / (sqrt(normV1) * sqrt(normV2));
+}
+
+double VectorStore::l1Distance(const vector<float>& v1, const vector<float>& v2) const {
+    return distanceKernels().l1(v1.data(), v2.data(), min(v1.size(), v2.size()));
+}
+
+double VectorStore::l2Distance(const vector<float>& v1, const vector<float>& v2) const {
+    return sqrt(distanceKernels().squaredL2(v1.data(), v2.data(), min(v1.size(), v2.size())));
+}
+
+double VectorStore::estimateD_Linear(const std::vector<float>& query, int k, double averageDistance, const std::vector<float>& reference, double c0_bias, double c1_slope) {
+    if (count == 0 || k <= 0 || k > count) {
+        return 0.0;
+    }
+
+    double dr = l2Distance(query, reference);
+    return abs(dr - averageDistance) + c1_slope * averageDistance * k + c0_bias;
+}
+
+// Exact Euclidean kNN. Every record is keyed on d(x, ref), and
+// |d(q, ref) - d(x, ref)| <= d(q, x), so the scan expands outwards from
+// d(q, ref) in both directions and stops once that lower bound exceeds the
+// current k-th best distance. Returns (distance, id) sorted ascending.
+vector<pair<double, int>> VectorStore::exactNearestL2(const vector<float>& query, int k, int* evaluations) const {
+    vector<pair<double, int>> res;
+    if (evaluations) *evaluations = 0;
+    if (k <= 0 || count == 0) return res;
+
+    const DistanceKernels& kernels = distanceKernels();
+    size_t n = min(query.size(), (size_t)dimension);
+
+    double dq = l2Distance(query, *referenceVector);
+    const double inf = numeric_limits<double>::infinity();
+
+    // Max-heap on (distance, id): the current k-th best is on top
+    priority_queue<pair<double, int>> best;
+
+    withDistanceIndex([&](auto& index) {
+        auto first = index.begin();
+        auto last = index.end();
+        auto right = index.lowerBound(IndexKey::lowest(dq));
+        auto left = right;
+        bool hasLeft = (left != first);
+        if (hasLeft) --left;
+
+        while (true) {
+            double rightBound = (right != last) ? right.key().value - dq : inf;
+            double leftBound = hasLeft ? dq - left.key().value : inf;
+            double bound = min(rightBound, leftBound);
+
+            if (bound == inf) break;
+            if ((int)best.size() == k && bound > best.top().first) break;
+
+            int slot;
+            if (rightBound <= leftBound) {
+                slot = *right;
+                ++right;
+            } else {
+                slot = *left;
+                if (left == first) hasLeft = false;
+                else --left;
+            }
+
+            best.push({MetricTraits<EUCLIDEAN>::score(kernels, query.data(), vectors->row(slot), n), vectors->ownerOf(slot)});
+            if ((int)best.size() > k) best.pop();
+            if (evaluations) ++*evaluations;
+        }
+    });
+
+    res.resize(best.size());
+    for (int i = (int)best.size() - 1; i >= 0; --i) {
+        res[i] = best.top();
+        best.pop();
+    }
+    return res;
+}
+
+template <DistanceMetric M>
+pair<double, int> VectorStore::findNearestImpl(const vector<float>& query) const {
+    const DistanceKernels& kernels = distanceKernels();
+    size_t n = min(query.size(), (size_t)dimension);
+    double normQ = queryNorm<M>(kernels, query.data(), n);
+
+    // Straight pass over the arena rows, one chunk per task, keeping
+    // (score, slot); of equal scores the first in distance order wins
+    auto wins = [&](const pair<double, int>& a, const pair<double, int>& b) {
+        if (MetricTraits<M>::better(a.first, b.first)) return true;
+        return a.first == b.first && b.second >= 0 && keyOf(a.second) < keyOf(b.second);
+    };
+
+    int slots = vectors->slotCount();
+    int chunks = chunkCount(slots, PARALLEL_MIN_SLOTS);
+    vector<pair<double, int>> chunkBest(chunks, {MetricTraits<M>::worst(), -1});
+
+    forEachChunk(slots, chunks, [&](int chunk, int begin, int end) {
+        pair<double, int>& best = chunkBest[chunk];
+        for (int slot = begin; slot < end; ++slot) {
+            if (!vectors->isLive(slot)) continue;
+
+            pair<double, int> candidate = {scoreRow<M>(kernels, query.data(), normQ, n, *vectors, slot), slot};
+            if (wins(candidate, best)) best = candidate;
+        }
+    });
+
+    pair<double, int> nearest = {MetricTraits<M>::worst(), -1};
+    for (const pair<double, int>& best : chunkBest) {
+        if (best.second >= 0 && wins(best, nearest)) nearest = best;
+    }
+    if (nearest.second >= 0) nearest.second = records[nearest.second].id;
+    return nearest;
+}
+
+pair<double, int> VectorStore::nearestScored(const vector<float>& query, DistanceMetric metric, bool exact) const {
+    if (exact && metric == EUCLIDEAN) {
+        vector<pair<double, int>> nearest = exactNearestL2(query, 1);
+        return nearest.empty() ? pair<double, int>(0.0, -1) : nearest[0];
+    }
+
+    switch (metric) {
+        case COSINE:    return findNearestImpl<COSINE>(query);
+        case EUCLIDEAN: return findNearestImpl<EUCLIDEAN>(query);
+        case MANHATTAN: return findNearestImpl<MANHATTAN>(query);
+    }
+    throw invalid_metric();
+}
+
+int VectorStore::findNearest(const vector<float>& query, string metric, bool exact) {
+    return findNearest(query, parseMetric(metric), exact);
+}
+
+int VectorStore::findNearest(const vector<float>& query, DistanceMetric metric, bool exact) {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->findNearest(query, metric, exact);
+
+    return nearestScored(query, metric, exact).second;
+}
+
+// Scores the candidates and keeps the k best, best first, ties by id
+template <DistanceMetric M>
+vector<pair<double, int>> VectorStore::topKImpl(const vector<float>& query, const vector<int>& candidateSlots, int k) const {
+    const DistanceKernels& kernels = distanceKernels();
+    size_t n = min(query.size(), (size_t)dimension);
+    double normQ = queryNorm<M>(kernels, query.data(), n);
+
+    auto better = [](const pair<double, int>& a, const pair<double, int>& b) {
+        if (a.first != b.first) return MetricTraits<M>::better(a.first, b.first);
+        return a.second < b.second;
+    };
+
+    // Each chunk scores its candidates and keeps its own k best, sorted
+    int total = (int)candidateSlots.size();
+    int chunks = chunkCount(total, PARALLEL_MIN_SLOTS);
+    vector<vector<pair<double, int>>> runs(chunks);
+
+    forEachChunk(total, chunks, [&](int chunk, int begin, int end) {
+        vector<pair<double, int>>& scores = runs[chunk];
+        scores.reserve(end - begin);
+        for (int i = begin; i < end; ++i) {
+            int slot = candidateSlots[i];
+            double score = scoreRow<M>(kernels, query.data(), normQ, n, *vectors, slot);
+            scores.push_back({score, vectors->ownerOf(slot)});
+        }
+
+        int keep = min(k, (int)scores.size());
+        partial_sort(scores.begin(), scores.begin() + keep, scores.end(), better);
+        scores.resize(keep);
+    });
+
+    if (chunks == 1) return runs[0];
+
+    // The order is total, so the result is the same however the
+    // candidates were split
+    return mergeSortedRuns(runs, k, better);
+}
+
+int* VectorStore::topKNearest(const vector<float>& query, int k, string metric, bool exact) {
+    return topKNearest(query, k, parseMetric(metric), exact);
+}
+
+int* VectorStore::topKNearest(const vector<float>& query, int k, DistanceMetric metric, bool exact) {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->topKNearest(query, k, metric, exact);
+
+    vector<pair<double, int>> best = topKScored(query, k, metric, exact);
+
+    int* result = new int[best.size()];
+    for (size_t i = 0; i < best.size(); i++) {
+        result[i] = best[i].second;
+    }
+
+    return result;
+}
+
+// The k best (score, id) pairs, best first
+vector<pair<double, int>> VectorStore::topKScored(const vector<float>& query, int k, DistanceMetric metric, bool exact) {
+    if (k <= 0 || k > count) throw invalid_argument("Invalid k");
+    //if (k > count) k = count;
+
+    vector<pair<double, int>> best;
+
+    if (exact && metric == EUCLIDEAN) {
+        best = exactNearestL2(query, k);
+    } else {
+        vector<int> candidates;
+
+        if (exact) {
+            // No pruning bound for this metric: score every record
+            candidates.reserve(count);
+            int slots = vectors->slotCount();
+            for (int slot = 0; slot < slots; ++slot) {
+                if (vectors->isLive(slot)) candidates.push_back(slot);
+            }
+        } else {
+            double normQ = sqrt(distanceKernels().dot(query.data(), query.data(), query.size()));
+
+            double D = estimateD_Linear(query, k, averageDistance, *referenceVector);
+
+            double lower = normQ - D;
+            double upper = normQ + D;
+
+            // normIndex is keyed on the record norm: walk only [lower, upper]
+            if (frozen) {
+                int first = frozenNorm->lowerBound(IndexKey::lowest(lower));
+                int last = frozenNorm->upperBound(IndexKey::highest(upper));
+                for (int pos = first; pos < last; ++pos) {
+                    candidates.push_back(frozenNorm->valueAt(pos));
+                }
+            } else {
+                RedBlackTree<IndexKey, int>::Iterator it = normIndex->lowerBound(IndexKey::lowest(lower));
+                RedBlackTree<IndexKey, int>::Iterator last = normIndex->upperBound(IndexKey::highest(upper));
+                for (; it != last; ++it) {
+                    candidates.push_back(*it);
+                }
+            }
+        }
+
+        switch (metric) {
+            case COSINE:    best = topKImpl<COSINE>(query, candidates, k); break;
+            case EUCLIDEAN: best = topKImpl<EUCLIDEAN>(query, candidates, k); break;
+            case MANHATTAN: best = topKImpl<MANHATTAN>(query, candidates, k); break;
+        }
+    }
+
+    return best;
+}
+
+int VectorStore::exactSearchEvaluations(const vector<float>& query, int k) const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->exactSearchEvaluations(query, k);
+
+    if (k <= 0 || k > count) throw invalid_argument("Invalid k");
+
+    int evaluations = 0;
+    exactNearestL2(query, k, &evaluations);
+    return evaluations;
+}
+
+int* VectorStore::rangeQueryFromRoot(double minDist, double maxDist) const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->rangeQueryFromRoot(minDist, maxDist);
+
+    vector<int> resultIds = rangeFromRootIds(minDist, maxDist);
+
+    int size = resultIds.size();
+    int* result = new int[size];
+    for (int i = 0; i < size; i++) {
+        result[i] = resultIds[i];
+    }
+
+    return result;
+}
+
+// Ids with distance in [minDist, maxDist], in distance order
+vector<int> VectorStore::rangeFromRootIds(double minDist, double maxDist) const {
+    vector<int> resultIds;
+    if (count == 0 || rootSlot < 0 || minDist > maxDist) {
+        return resultIds;
+    }
+
+    if (frozen) {
+        int first = frozenDistance->lowerBound(IndexKey::lowest(minDist));
+        int last = frozenDistance->upperBound(IndexKey::highest(maxDist));
+        for (int pos = first; pos < last; ++pos) {
+            resultIds.push_back(records[frozenDistance->valueAt(pos)].id);
+        }
+    } else {
+        auto action = [&](const int& slot) {
+            resultIds.push_back(records[slot].id);
+        };
+        withDistanceIndex([&](auto& index) { index.rangeVisit(IndexKey::lowest(minDist), IndexKey::highest(maxDist), action); });
+    }
+
+    return resultIds;
+}
+
+template <DistanceMetric M>
+vector<int> VectorStore::rangeQueryImpl(const vector<float>& query, double radius) const {
+    const DistanceKernels& kernels = distanceKernels();
+    size_t n = min(query.size(), (size_t)dimension);
+    double normQ = queryNorm<M>(kernels, query.data(), n);
+
+    int slots = vectors->slotCount();
+    int chunks = chunkCount(slots, PARALLEL_MIN_SLOTS);
+    vector<vector<int>> parts(chunks);
+
+    forEachChunk(slots, chunks, [&](int chunk, int begin, int end) {
+        for (int slot = begin; slot < end; ++slot) {
+            if (!vectors->isLive(slot)) continue;
+
+            double score = scoreRow<M>(kernels, query.data(), normQ, n, *vectors, slot);
+            if (MetricTraits<M>::within(score, radius)) {
+                parts[chunk].push_back(slot);
+            }
+        }
+    });
+
+    return idsInDistanceOrder(concatChunks(parts));
+}
+
+int* VectorStore::rangeQuery(const vector<float>& query, double radius, string metric) const {
+    return rangeQuery(query, radius, parseMetric(metric));
+}
+
+int* VectorStore::rangeQuery(const vector<float>& query, double radius, DistanceMetric metric) const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->rangeQuery(query, radius, metric);
+
+    if (count == 0) {
+        return new int[0];
+    }
+
+    vector<int> resultIds;
+    switch (metric) {
+        case COSINE:    resultIds = rangeQueryImpl<COSINE>(query, radius); break;
+        case EUCLIDEAN: resultIds = rangeQueryImpl<EUCLIDEAN>(query, radius); break;
+        case MANHATTAN: resultIds = rangeQueryImpl<MANHATTAN>(query, radius); break;
+    }
+
+    int* result = new int[resultIds.size()];
+    for (size_t i = 0; i < resultIds.size(); i++) {
+        result[i] = resultIds[i];
+    }
+
+    return result;
+}
+
+int* VectorStore::boundingBoxQuery(const vector<float>& minBound, const vector<float>& maxBound) const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->boundingBoxQuery(minBound, maxBound);
+
+    vector<int> ids = boundingBoxIds(minBound, maxBound);
+
+    int* result = new int[ids.size()];
+    for (size_t i = 0; i < ids.size(); i++) {
+        result[i] = ids[i];
+    }
+    return result;
+}
+
+vector<int> VectorStore::idsInDistanceOrder(vector<int> slots) const {
+    sort(slots.begin(), slots.end(), [&](int a, int b) { return keyOf(a) < keyOf(b); });
+    for (int& slot : slots) slot = records[slot].id;
+    return slots;
+}
+
+// Ids of the records inside the box, in distance order
+vector<int> VectorStore::boundingBoxIds(const vector<float>& minBound, const vector<float>& maxBound) const {
+    if (count == 0 || minBound.size() != maxBound.size() || minBound.empty()) {
+        return vector<int>();
+    }
+    
+    for (size_t i = 0; i < minBound.size(); i++) {
+        if (minBound[i] > maxBound[i]) {
+            return vector<int>();
+        }
+    }
+    
+    size_t d = min(minBound.size(), (size_t)dimension);
+
+    int slots = vectors->slotCount();
+    int chunks = chunkCount(slots, PARALLEL_MIN_SLOTS);
+    vector<vector<int>> parts(chunks);
+
+    forEachChunk(slots, chunks, [&](int chunk, int begin, int end) {
+        for (int slot = begin; slot < end; ++slot) {
+            if (!vectors->isLive(slot)) continue;
+
+            const float* v = vectors->row(slot);
+            bool inside = true;
+
+            for (size_t i = 0; i < d; i++) {
+                if (v[i] < minBound[i] || v[i] > maxBound[i]) {
+                    inside = false;
+                    break;
+                }
+            }
+
+            if (inside) {
+                parts[chunk].push_back(slot);
+            }
+        }
+    });
+    return idsInDistanceOrder(concatChunks(parts));
+}
+
+// Tile sizes for the batch queries: a record tile is about 128 KB of
+// rows so it stays in L2 while a tile of queries is scored against it
+static const int BATCH_QUERY_TILE = 32;
+static const size_t BATCH_RECORD_TILE_BYTES = 128 * 1024;
+
+template <DistanceMetric M, typename Visit>
+void VectorStore::scanBatch(const float* queries, int nq, Visit visit) const {
+    const DistanceKernels& kernels = distanceKernels();
+    size_t n = dimension;
+
+    vector<double> normQ(nq);
+    for (int q = 0; q < nq; ++q) {
+        normQ[q] = queryNorm<M>(kernels, queries + q * n, n);
+    }
+
+    int slots = vectors->slotCount();
+    int recordTile = (int)max((size_t)8, BATCH_RECORD_TILE_BYTES / max((size_t)1, n * sizeof(float)));
+
+    auto scanTile = [&](int q0, int q1) {
+        for (int s0 = 0; s0 < slots; s0 += recordTile) {
+            int s1 = min(slots, s0 + recordTile);
+            for (int q = q0; q < q1; ++q) {
+                const float* query = queries + q * n;
+                for (int slot = s0; slot < s1; ++slot) {
+                    if (!vectors->isLive(slot)) continue;
+                    visit(q, slot, MetricTraits<M>::score(kernels, query, vectors->row(slot), n, normQ[q], vectors->norm(slot)));
+                }
+            }
+        }
+    };
+
+    // Query tiles are independent: each query's state is only touched by
+    // the task owning its tile
+    int queryTiles = (nq + BATCH_QUERY_TILE - 1) / BATCH_QUERY_TILE;
+    forEachChunk(queryTiles, chunkCount(queryTiles, 1), [&](int, int tileBegin, int tileEnd) {
+        for (int tile = tileBegin; tile < tileEnd; ++tile) {
+            scanTile(tile * BATCH_QUERY_TILE, min(nq, (tile + 1) * BATCH_QUERY_TILE));
+        }
+    });
+}
+
+int* VectorStore::findNearestBatch(const float* queries, int nq, DistanceMetric metric) const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->findNearestBatch(queries, nq, metric);
+
+    vector<pair<double, int>> best = nearestBatchScored(queries, nq, metric);
+
+    int* result = new int[nq];
+    for (int q = 0; q < nq; ++q) {
+        result[q] = best[q].second;
+    }
+    return result;
+}
+
+vector<pair<double, int>> VectorStore::nearestBatchScored(const float* queries, int nq, DistanceMetric metric) const {
+    if (nq < 0 || (nq > 0 && !queries)) throw invalid_argument("Invalid query batch");
+
+    vector<pair<double, int>> best(nq, pair<double, int>(0.0, -1));
+
+    auto run = [&](auto traits) {
+        using Traits = decltype(traits);
+        vector<double> bestScore(nq, Traits::worst());
+        vector<int> bestSlot(nq, -1);
+        scanBatch<Traits::METRIC>(queries, nq, [&](int q, int slot, double score) {
+            if (Traits::better(score, bestScore[q])
+                || (score == bestScore[q] && bestSlot[q] >= 0 && keyOf(slot) < keyOf(bestSlot[q]))) {
+                bestScore[q] = score;
+                bestSlot[q] = slot;
+                best[q] = pair<double, int>(score, vectors->ownerOf(slot));
+            }
+        });
+    };
+
+    switch (metric) {
+        case COSINE:    run(MetricTraits<COSINE>()); break;
+        case EUCLIDEAN: run(MetricTraits<EUCLIDEAN>()); break;
+        case MANHATTAN: run(MetricTraits<MANHATTAN>()); break;
+    }
+    return best;
+}
+
+int* VectorStore::topKNearestBatch(const float* queries, int nq, int k, DistanceMetric metric) const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->topKNearestBatch(queries, nq, k, metric);
+
+    vector<vector<pair<double, int>>> best = topKBatchScored(queries, nq, k, metric);
+
+    int* result = new int[(size_t)nq * k];
+    for (int q = 0; q < nq; ++q) {
+        int* out = result + (size_t)q * k;
+        for (int i = 0; i < k; ++i) {
+            out[i] = best[q][i].second;
+        }
+    }
+    return result;
+}
+
+vector<vector<pair<double, int>>> VectorStore::topKBatchScored(const float* queries, int nq, int k, DistanceMetric metric) const {
+    if (k <= 0 || k > count) throw invalid_argument("Invalid k");
+    if (nq < 0 || (nq > 0 && !queries)) throw invalid_argument("Invalid query batch");
+
+    vector<vector<pair<double, int>>> best(nq);
+
+    // One bounded heap per query with the worst kept result on top; the
+    // order is the one topKImpl sorts by, ties broken by id
+    auto run = [&](auto traits) {
+        using Traits = decltype(traits);
+        auto better = [](const pair<double, int>& a, const pair<double, int>& b) {
+            if (a.first != b.first) return Traits::better(a.first, b.first);
+            return a.second < b.second;
+        };
+        typedef priority_queue<pair<double, int>, vector<pair<double, int>>, decltype(better)> Heap;
+        vector<Heap> heaps(nq, Heap(better));
+
+        scanBatch<Traits::METRIC>(queries, nq, [&](int q, int slot, double score) {
+            Heap& heap = heaps[q];
+            pair<double, int> entry(score, vectors->ownerOf(slot));
+            if ((int)heap.size() < k) {
+                heap.push(entry);
+            } else if (better(entry, heap.top())) {
+                heap.pop();
+                heap.push(entry);
+            }
+        });
+
+        for (int q = 0; q < nq; ++q) {
+            best[q].resize(k);
+            for (int i = k - 1; i >= 0; --i) {
+                best[q][i] = heaps[q].top();
+                heaps[q].pop();
+            }
+        }
+    };
+
+    switch (metric) {
+        case COSINE:    run(MetricTraits<COSINE>()); break;
+        case EUCLIDEAN: run(MetricTraits<EUCLIDEAN>()); break;
+        case MANHATTAN: run(MetricTraits<MANHATTAN>()); break;
+    }
+    return best;
+}
+
+int* VectorStore::rangeQueryBatch(const float* queries, int nq, double radius, DistanceMetric metric,
+                                  vector<int>& offsets) const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->rangeQueryBatch(queries, nq, radius, metric, offsets);
+
+    vector<vector<int>> hits = rangeBatchIds(queries, nq, radius, metric);
+
+    offsets.assign(nq + 1, 0);
+    for (int q = 0; q < nq; ++q) {
+        offsets[q + 1] = offsets[q] + (int)hits[q].size();
+    }
+
+    int* result = new int[offsets[nq]];
+    for (int q = 0; q < nq; ++q) {
+        copy(hits[q].begin(), hits[q].end(), result + offsets[q]);
+    }
+    return result;
+}
+
+vector<vector<int>> VectorStore::rangeBatchIds(const float* queries, int nq, double radius, DistanceMetric metric) const {
+    if (nq < 0 || (nq > 0 && !queries)) throw invalid_argument("Invalid query batch");
+
+    vector<vector<int>> hits(nq);
+    auto run = [&](auto traits) {
+        using Traits = decltype(traits);
+        scanBatch<Traits::METRIC>(queries, nq, [&](int q, int slot, double score) {
+            if (Traits::within(score, radius)) hits[q].push_back(slot);
+        });
+    };
+
+    switch (metric) {
+        case COSINE:    run(MetricTraits<COSINE>()); break;
+        case EUCLIDEAN: run(MetricTraits<EUCLIDEAN>()); break;
+        case MANHATTAN: run(MetricTraits<MANHATTAN>()); break;
+    }
+    for (vector<int>& slots : hits) slots = idsInDistanceOrder(std::move(slots));
+    return hits;
+}
+
+double VectorStore::getMaxDistance() const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->getMaxDistance();
+
+	if (count == 0 || rootSlot < 0)  return 0.0;
+    if (frozen) return frozenDistance->keyAt(frozenDistance->size() - 1).value;
+
+    // Rightmost entry of the distance index
+    double maxDist = 0.0;
+    withDistanceIndex([&](auto& index) {
+        auto it = index.last();
+        if (it != index.end()) maxDist = it.key().value;
+    });
+    return maxDist;
+}
+
+double VectorStore::getMinDistance() const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->getMinDistance();
+
+	if (count == 0) return 0.0;
+    if (frozen) return frozenDistance->keyAt(0).value;
+
+	double minDist = 0.0;
+	withDistanceIndex([&](auto& index) {
+		if (!index.empty()) minDist = index.begin().key().value;
+	});
+	return minDist;
+}
+
+VectorRecord VectorStore::computeCentroid(const std::vector<VectorRecord*>& records) const {
+    ReadGuard guard(*this);
+    if (VectorStore* view = guard.snapshot()) return view->computeCentroid(records);
+
+	if (records.empty()) {
+		return VectorRecord(-1, "", nullptr, 0.0);
+	}
+
+	size_t d = dimension;
+	vector<float>* sumVec = new vector<float>(d, 0.0f);
+
+	for (VectorRecord* rec : records) {
+		const float* vec = getVectorData(rec);
+		for (size_t i = 0; i < d; i++) {
+			(*sumVec)[i] += vec[i];
+		}
+	}
+
+	for (size_t i = 0; i < d; i++) {
+		(*sumVec)[i] /= records.size();
+	}
+
+	double distToRef = l2Distance(*sumVec, *referenceVector);
+	return VectorRecord(-1, "centroid", sumVec, distToRef);
+}
+
+VectorRecord* VectorStore::findVectorNearestToDistance(double targetDistance) const {
+	if (count == 0) {
+		return nullptr;
+	}
+
+	// Only the neighbours of targetDistance can be closest; a tie goes to
+	// the smaller distance
+	int bestSlot = -1;
+	withDistanceIndex([&](auto& index) {
+		auto below = index.floor(IndexKey::highest(targetDistance));
+		auto above = index.ceiling(IndexKey::lowest(targetDistance));
+
+		double minDiff = numeric_limits<double>::max();
+		if (below != index.end()) {
+			minDiff = targetDistance - below.key().value;
+			bestSlot = *below;
+		}
+		if (above != index.end() && above.key().value - targetDistance < minDiff) {
+			bestSlot = *above;
+		}
+	});
+
+	if (bestSlot < 0) return nullptr;
+	return const_cast<VectorRecord*>(&records[bestSlot]);
+}
+
+// =====================================
+// ShardedVectorStore implementation
+// =====================================
+ShardedVectorStore::ShardedVectorStore(int shardCount,
+                                       int dimension,
+                                       std::vector<float>* (*embeddingFunction)(const std::string&),
+                                       const std::vector<float>& referenceVector,
+                                       IndexKind indexKind)
+    : pool(nullptr), curId(1) {
+    if (shardCount <= 0) throw invalid_argument("Invalid shard count");
+
+    for (int i = 0; i < shardCount; ++i) {
+        shards.push_back(new VectorStore(dimension, embeddingFunction, referenceVector, indexKind));
+    }
+    setWorkerCount(min(shardCount, max(1, (int)std::thread::hardware_concurrency())));
+}
+
+ShardedVectorStore::~ShardedVectorStore() {
+    delete pool;
+    for (VectorStore* shard : shards) delete shard;
+}
+
+// Fibonacci hashing, as in IdIndex
+int ShardedVectorStore::shardOf(int id) const {
+    uint64_t h = (uint64_t)(uint32_t)id * 11400714819323198485ull;
+    return (int)((h >> 32) % shards.size());
+}
+
+template <typename Func>
+void ShardedVectorStore::fanOut(Func f) const {
+    int count = (int)shards.size();
+    if (pool) {
+        pool->parallelFor(count, [&](int shard) { f(shard); });
+    } else {
+        for (int shard = 0; shard < count; ++shard) f(shard);
+    }
+}
+
+// A shard's writer is the thread that last changed it, and only that one
+// reads it live; a worker from the pool must not take the role
+template <typename Func>
+void ShardedVectorStore::fanOutWrite(Func f) {
+    if (!concurrentReads()) {
+        fanOut(f);
+        return;
+    }
+    for (int shard = 0; shard < (int)shards.size(); ++shard) f(shard);
+}
+
+void ShardedVectorStore::setWorkerCount(int workers) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    if (workers <= 0) workers = max(1, (int)std::thread::hardware_concurrency());
+    if (workers == getWorkerCount()) return;
+
+    delete pool;
+    pool = (workers > 1) ? new ThreadPool(workers) : nullptr;
+}
+
+int ShardedVectorStore::getWorkerCount() const {
+    return pool ? pool->size() : 1;
+}
+
+// ---------- Concurrent reads ----------
+void ShardedVectorStore::enableConcurrentReads(int publishInterval) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    for (VectorStore* shard : shards) shard->enableConcurrentReads(publishInterval);
+}
+
+void ShardedVectorStore::disableConcurrentReads() {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    for (VectorStore* shard : shards) shard->disableConcurrentReads();
+}
+
+void ShardedVectorStore::publish() {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    for (VectorStore* shard : shards) shard->publish();
+}
+
+// Shards with concurrent reads off need no guard; the guards of the
+// others pin in shard order and unpin in reverse
+ShardedVectorStore::ReadGuard::ReadGuard(const ShardedVectorStore& store)
+    : views(store.shards) {
+    for (size_t shard = 0; shard < views.size(); ++shard) {
+        if (!views[shard]->concurrentReads()) continue;
+
+        guards.emplace_back(new VectorStore::ReadGuard(*views[shard]));
+        if (VectorStore* view = guards.back()->snapshot()) views[shard] = view;
+    }
+}
+
+ShardedVectorStore::ReadGuard::~ReadGuard() {
+    while (!guards.empty()) guards.pop_back();
+}
+
+const std::vector<VectorStore*>& ShardedVectorStore::ReadGuard::pinnedShards() const {
+    for (const std::unique_ptr<VectorStore::ReadGuard>& guard : guards) guard->pinnedSnapshot();
+    return views;
+}
+
+// ---------- Records ----------
+int ShardedVectorStore::size() {
+    ReadGuard guard(*this);
+    int total = 0;
+    for (VectorStore* shard : guard.shards()) total += shard->count;
+    return total;
+}
+
+bool ShardedVectorStore::empty() {
+    return size() == 0;
+}
+
+void ShardedVectorStore::clear() {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    fanOutWrite([&](int shard) { shards[shard]->clear(); });
+    curId = 1;
+}
+
+std::vector<float>* ShardedVectorStore::preprocessing(std::string rawText) {
+    return shards[0]->preprocessing(rawText);
+}
+
+void ShardedVectorStore::addText(std::string rawText) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    int id = curId++;
+    VectorStore& shard = *shards[shardOf(id)];
+    VectorStore::WriteGuard guard(shard);
+    shard.insertText(rawText, id);
+}
+
+// The index-th record overall is the one with exactly index keys below it
+// across all shards. Each shard is binary searched for it in turn.
+pair<int, int> ShardedVectorStore::locate(const vector<VectorStore*>& stores, int index) const {
+    int count = (int)stores.size();
+    for (int s = 0; s < count; ++s) {
+        int lo = 0, hi = stores[s]->count - 1;
+        while (lo <= hi) {
+            int mid = lo + (hi - lo) / 2;
+            IndexKey key = stores[s]->keyOf(stores[s]->slotAt(mid));
+
+            int rank = mid;
+            for (int t = 0; t < count; ++t) {
+                if (t != s) rank += stores[t]->rankOf(key);
+            }
+
+            if (rank == index) return {s, mid};
+            if (rank < index) lo = mid + 1;
+            else hi = mid - 1;
+        }
+    }
+    throw out_of_range("Index is invalid!");
+}
+
+VectorRecord* ShardedVectorStore::getVector(int index) {
+    ReadGuard guard(*this);
+    const vector<VectorStore*>& stores = guard.pinnedShards();
+
+    pair<int, int> at = locate(stores, index);
+    return stores[at.first]->getVector(at.second);
+}
+
+std::string ShardedVectorStore::getRawText(int index) {
+    ReadGuard guard(*this);
+    return getVector(index)->rawText;
+}
+
+int ShardedVectorStore::getId(int index) {
+    ReadGuard guard(*this);
+    return getVector(index)->id;
+}
+
+// Under writeMutex the live shards cannot change, so they are searched
+// directly rather than through snapshots
+bool ShardedVectorStore::removeAt(int index) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    pair<int, int> at = locate(shards, index);
+    return shards[at.first]->removeAt(at.second);
+}
+
+VectorRecord* ShardedVectorStore::getById(int id) {
+    if (id < 0) return nullptr;
+    return shards[shardOf(id)]->getById(id);
+}
+
+bool ShardedVectorStore::removeById(int id) {
+    if (id < 0) return false;
+    std::lock_guard<std::mutex> lock(writeMutex);
+    return shards[shardOf(id)]->removeById(id);
+}
+
+bool ShardedVectorStore::containsId(int id) const {
+    if (id < 0) return false;
+    return shards[shardOf(id)]->containsId(id);
+}
+
+void ShardedVectorStore::compactVectors() {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    fanOutWrite([&](int shard) { shards[shard]->compactVectors(); });
+}
+
+void ShardedVectorStore::freeze() {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    fanOutWrite([&](int shard) { shards[shard]->freeze(); });
+}
+
+void ShardedVectorStore::thaw() {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    fanOutWrite([&](int shard) { shards[shard]->thaw(); });
+}
+
+bool ShardedVectorStore::isFrozen() const {
+    ReadGuard guard(*this);
+    for (VectorStore* shard : guard.shards()) {
+        if (!shard->frozen) return false;
+    }
+    return true;
+}
+
+const float* ShardedVectorStore::getVectorData(const VectorRecord* record) const {
+    if (!record) return nullptr;
+    return shards[shardOf(record->id)]->getVectorData(record);
+}
+
+void ShardedVectorStore::setReferenceVector(const std::vector<float>& newReference) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    fanOutWrite([&](int shard) { shards[shard]->setReferenceVector(newReference); });
+}
+
+std::vector<float>* ShardedVectorStore::getReferenceVector() const {
+    return shards[0]->getReferenceVector();
+}
+
+VectorRecord* ShardedVectorStore::getRootVector() const {
+    ReadGuard guard(*this);
+    const vector<VectorStore*>& stores = guard.pinnedShards();
+    double average = getAverageDistance();
+
+    VectorRecord* root = nullptr;
+    for (VectorStore* shard : stores) {
+        VectorRecord* candidate = shard->getRootVector();
+        if (!candidate) continue;
+
+        if (!root) {
+            root = candidate;
+            continue;
+        }
+        double diff = abs(candidate->distanceFromReference - average);
+        double best = abs(root->distanceFromReference - average);
+        if (diff < best || (diff == best && candidate->id < root->id)) root = candidate;
+    }
+    return root;
+}
 
-    if (count == 0) {
-        delete rootVector;
-        rootVector = nullptr;
+double ShardedVectorStore::getAverageDistance() const {
+    ReadGuard guard(*this);
+    double total = 0.0;
+    int count = 0;
+    for (VectorStore* shard : guard.shards()) {
+        total += shard->averageDistance * shard->count;
+        count += shard->count;
     }
+    return (count == 0) ? 0.0 : total / count;
+}
 
-    return true;
+void ShardedVectorStore::setEmbeddingFunction(std::vector<float>* (*newEmbeddingFunction)(const std::string&)) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    for (VectorStore* shard : shards) shard->setEmbeddingFunction(newEmbeddingFunction);
 }
 
-void VectorStore::setReferenceVector(const std::vector<float>& newReference) {
-    *referenceVector = newReference;
+void ShardedVectorStore::forEach(void (*action)(std::vector<float>&, int, std::string&)) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    for (VectorStore* shard : shards) shard->forEach(action);
+}
 
-    vector<VectorRecord*> allRecords;
-    auto action = [&allRecords](const VectorRecord& r) {
-        allRecords.push_back(const_cast<VectorRecord*>(&r));
-    };
+std::vector<int> ShardedVectorStore::getAllIdsSortedByDistance() const {
+    vector<int> ids;
+    for (VectorRecord* record : getAllVectorsSortedByDistance()) ids.push_back(record->id);
+    return ids;
+}
 
-    vectorStore->inorder(action);
+// Each shard's list is already sorted, so a k-way merge on the key gives
+// the global order
+std::vector<VectorRecord*> ShardedVectorStore::getAllVectorsSortedByDistance() const {
+    ReadGuard guard(*this);
+    const vector<VectorStore*>& stores = guard.pinnedShards();
 
-    vectorStore->clear();
-    normIndex->clear();
+    auto key = [](const VectorRecord* record) { return IndexKey(record->distanceFromReference, record->id); };
+    auto later = [&](const pair<VectorRecord*, size_t>& a, const pair<VectorRecord*, size_t>& b) {
+        return key(b.first) < key(a.first);
+    };
 
-    if (allRecords.empty()) return;
+    vector<vector<VectorRecord*>> runs;
+    size_t total = 0;
+    for (VectorStore* shard : stores) {
+        runs.push_back(shard->getAllVectorsSortedByDistance());
+        total += runs.back().size();
+    }
 
-    double totalDist = 0.0;
-    for (VectorRecord* r : allRecords) {
-        double newDist = l2Distance(*(r->vector), *referenceVector);
-        r->distanceFromReference = newDist;
-        totalDist += newDist;
-
-        double norm = 0.0;
-        for (float val : *(r->vector)) {
-            norm += pow(val, 2);
-        }
-        norm = sqrt(norm);
+    // (record, run) with the smallest key on top; positions per run
+    priority_queue<pair<VectorRecord*, size_t>, vector<pair<VectorRecord*, size_t>>, decltype(later)> heads(later);
+    vector<size_t> pos(runs.size(), 0);
+    for (size_t r = 0; r < runs.size(); ++r) {
+        if (!runs[r].empty()) heads.push({runs[r][0], r});
+    }
 
-        vectorStore->insert(newDist, *r);
-        normIndex->insert(norm, *r);
+    vector<VectorRecord*> merged;
+    merged.reserve(total);
+    while (!heads.empty()) {
+        size_t r = heads.top().second;
+        merged.push_back(heads.top().first);
+        heads.pop();
+        if (++pos[r] < runs[r].size()) heads.push({runs[r][pos[r]], r});
     }
+    return merged;
+}
 
-    this->averageDistance = totalDist / count;
+double ShardedVectorStore::cosineSimilarity(const std::vector<float>& v1, const std::vector<float>& v2) const {
+    return shards[0]->cosineSimilarity(v1, v2);
+}
 
-    VectorRecord* bestRoot = nullptr;
-    double minDiff = numeric_limits<double>::max();
+double ShardedVectorStore::l1Distance(const std::vector<float>& v1, const std::vector<float>& v2) const {
+    return shards[0]->l1Distance(v1, v2);
+}
 
-    for (VectorRecord* r : allRecords) {
-        double diff = abs(r->distanceFromReference - this->averageDistance);
-        if (diff < minDiff) {
-            minDiff = diff;
-            bestRoot = r;
-        }
+double ShardedVectorStore::l2Distance(const std::vector<float>& v1, const std::vector<float>& v2) const {
+    return shards[0]->l2Distance(v1, v2);
+}
+
+// VectorStore's estimate, with k checked against the total size
+double ShardedVectorStore::estimateD_Linear(const std::vector<float>& query, int k, double averageDistance, const std::vector<float>& reference, double c0_bias, double c1_slope) {
+    if (k <= 0 || k > size()) {
+        return 0.0;
     }
 
-    delete this->rootVector;
-    if (bestRoot) rootVector = new VectorRecord(*bestRoot);
-    else rootVector = nullptr;
+    double dr = l2Distance(query, reference);
+    return abs(dr - averageDistance) + c1_slope * averageDistance * k + c0_bias;
 }
 
-vector<float>* VectorStore::getReferenceVector() const {
-    return this->referenceVector;
+// ---------- Queries ----------
+// Best first for metric, ties by id: the order VectorStore::topKImpl sorts by
+static bool betterScored(DistanceMetric metric, const pair<double, int>& a, const pair<double, int>& b) {
+    if (a.first != b.first) return (metric == COSINE) ? a.first > b.first : a.first < b.first;
+    return a.second < b.second;
 }
 
-VectorRecord* VectorStore::getRootVector() const {
-    return this->rootVector;
+static int* toArray(const vector<int>& ids) {
+    int* result = new int[ids.size()];
+    copy(ids.begin(), ids.end(), result);
+    return result;
 }
 
-double VectorStore::getAverageDistance() const {
-    return this->averageDistance;
+int ShardedVectorStore::findNearest(const std::vector<float>& query, std::string metric, bool exact) {
+    return findNearest(query, VectorStore::parseMetric(metric), exact);
 }
 
-void VectorStore::setEmbeddingFunction(std::vector<float>* (*newEmbeddingFunction)(const std::string&)) {
-    this->embeddingFunction = newEmbeddingFunction; 
-}
+int ShardedVectorStore::findNearest(const std::vector<float>& query, DistanceMetric metric, bool exact) {
+    ReadGuard guard(*this);
+    const vector<VectorStore*>& stores = guard.shards();
 
-void VectorStore::forEach(void (*action)(vector<float>&, int, std::string&)) {
-    vectorStore->inorder([&action](const VectorRecord& record)->void {
-        action(*(record.vector), record.id, const_cast<std::string&>(record.rawText));
+    vector<vector<pair<double, int>>> runs(stores.size());
+    fanOut([&](int shard) {
+        if (stores[shard]->count > 0) runs[shard].push_back(stores[shard]->nearestScored(query, metric, exact));
     });
-}
-
-std::vector<int> VectorStore::getAllIdsSortedByDistance() const {
-	std::vector<int> idVec;
 
-	auto action = [&](const VectorRecord& r) {
-		idVec.push_back(r.id);
-	};
+    auto better = [&](const pair<double, int>& a, const pair<double, int>& b) { return betterScored(metric, a, b); };
+    vector<pair<double, int>> best = mergeSortedRuns(runs, 1, better);
+    return best.empty() ? -1 : best[0].second;
+}
 
-	vectorStore->inorder(action);
-	return idVec;
+int* ShardedVectorStore::topKNearest(const std::vector<float>& query, int k, std::string metric, bool exact) {
+    return topKNearest(query, k, VectorStore::parseMetric(metric), exact);
 }
 
-std::vector<VectorRecord*> VectorStore::getAllVectorsSortedByDistance() const {
-    std::vector<VectorRecord*> rVec;
+// Every shard returns its own k best (fewer if it is smaller); the global
+// k best are among them
+int* ShardedVectorStore::topKNearest(const std::vector<float>& query, int k, DistanceMetric metric, bool exact) {
+    ReadGuard guard(*this);
+    const vector<VectorStore*>& stores = guard.shards();
 
-    auto action = [&](const VectorRecord& r) {
-        rVec.push_back(const_cast<VectorRecord*>(&r));
-    };
-    vectorStore->inorder(action);
-    return rVec;
-}	
+    int total = 0;
+    for (VectorStore* shard : stores) total += shard->count;
+    if (k <= 0 || k > total) throw invalid_argument("Invalid k");
 
-double VectorStore::cosineSimilarity(const vector<float>& v1, const vector<float>& v2) {
-    double dotProduct = 0.0;
-    double normV1 = 0.0;
-    double normV2 = 0.0;
+    vector<vector<pair<double, int>>> runs(stores.size());
+    fanOut([&](int shard) {
+        int shardK = min(k, stores[shard]->count);
+        if (shardK > 0) runs[shard] = stores[shard]->topKScored(query, shardK, metric, exact);
+    });
 
-    for (int i = 0; i < v1.size(); ++i) {
-        dotProduct += v1[i] * v2[i];
-        normV1 += v1[i] * v1[i];
-        normV2 += v2[i] * v2[i];
-    }
+    auto better = [&](const pair<double, int>& a, const pair<double, int>& b) { return betterScored(metric, a, b); };
+    vector<pair<double, int>> best = mergeSortedRuns(runs, k, better);
 
-    return dotProduct / (sqrt(normV1) * sqrt(normV2));
+    int* result = new int[best.size()];
+    for (size_t i = 0; i < best.size(); i++) {
+        result[i] = best[i].second;
+    }
+    return result;
 }
 
-double VectorStore::cosineSimilarity(const vector<float>& v1, const vector<float>& v2) const {
-    double dotProduct = 0.0;
-    double normV1 = 0.0;
-    double normV2 = 0.0;
+int ShardedVectorStore::exactSearchEvaluations(const std::vector<float>& query, int k) const {
+    ReadGuard guard(*this);
+    const vector<VectorStore*>& stores = guard.shards();
 
-    for (int i = 0; i < v1.size(); ++i) {
-        dotProduct += v1[i] * v2[i];
-        normV1 += v1[i] * v1[i];
-        normV2 += v2[i] * v2[i];
-    }
+    int total = 0;
+    for (VectorStore* shard : stores) total += shard->count;
+    if (k <= 0 || k > total) throw invalid_argument("Invalid k");
 
-    return dotProduct / (sqrt(normV1) * sqrt(normV2));
-}
+    vector<int> evaluations(stores.size(), 0);
+    fanOut([&](int shard) {
+        int shardK = min(k, stores[shard]->count);
+        if (shardK > 0) stores[shard]->exactNearestL2(query, shardK, &evaluations[shard]);
+    });
 
-double VectorStore::l1Distance(const vector<float>& v1, const vector<float>& v2) {
-    double sum = 0.0;
+    total = 0;
+    for (int e : evaluations) total += e;
+    return total;
+}
 
-    for (int i = 0; i < v1.size(); ++i) {
-        sum += fabs(v1[i] - v2[i]);
+vector<int> ShardedVectorStore::unionByDistance(const vector<VectorStore*>& stores, const vector<vector<int>>& parts) const {
+    vector<IndexKey> keys;
+    for (size_t shard = 0; shard < stores.size(); ++shard) {
+        const VectorStore& store = *stores[shard];
+        for (int id : parts[shard]) {
+            keys.push_back(store.keyOf(store.idIndex.find(id)));
+        }
     }
+    sort(keys.begin(), keys.end());
 
-    return sum;
+    vector<int> ids;
+    ids.reserve(keys.size());
+    for (const IndexKey& key : keys) ids.push_back(key.id);
+    return ids;
 }
 
-double VectorStore::l1Distance(const vector<float>& v1, const vector<float>& v2) const {
-    double sum = 0.0;
+int* ShardedVectorStore::rangeQueryFromRoot(double minDist, double maxDist) const {
+    ReadGuard guard(*this);
+    const vector<VectorStore*>& stores = guard.shards();
 
-    for (int i = 0; i < v1.size(); ++i) {
-        sum += fabs(v1[i] - v2[i]);
-    }
+    vector<vector<int>> parts(stores.size());
+    fanOut([&](int shard) { parts[shard] = stores[shard]->rangeFromRootIds(minDist, maxDist); });
+    return toArray(unionByDistance(stores, parts));
+}
 
-    return sum;
+int* ShardedVectorStore::rangeQuery(const std::vector<float>& query, double radius, std::string metric) const {
+    return rangeQuery(query, radius, VectorStore::parseMetric(metric));
 }
 
-double VectorStore::l2Distance(const vector<float>& v1, const vector<float>& v2) {
-    double sum = 0.0;
+int* ShardedVectorStore::rangeQuery(const std::vector<float>& query, double radius, DistanceMetric metric) const {
+    ReadGuard guard(*this);
+    const vector<VectorStore*>& stores = guard.shards();
+
+    vector<vector<int>> parts(stores.size());
+    fanOut([&](int shard) {
+        const VectorStore& store = *stores[shard];
+        switch (metric) {
+            case COSINE:    parts[shard] = store.rangeQueryImpl<COSINE>(query, radius); break;
+            case EUCLIDEAN: parts[shard] = store.rangeQueryImpl<EUCLIDEAN>(query, radius); break;
+            case MANHATTAN: parts[shard] = store.rangeQueryImpl<MANHATTAN>(query, radius); break;
+        }
+    });
+    return toArray(unionByDistance(stores, parts));
+}
 
-    for (int i = 0; i < v1.size(); ++i) {
-        double diff = v1[i] - v2[i];
-        sum += diff * diff;
-    }
+int* ShardedVectorStore::boundingBoxQuery(const std::vector<float>& minBound, const std::vector<float>& maxBound) const {
+    ReadGuard guard(*this);
+    const vector<VectorStore*>& stores = guard.shards();
 
-    return sqrt(sum);
+    vector<vector<int>> parts(stores.size());
+    fanOut([&](int shard) { parts[shard] = stores[shard]->boundingBoxIds(minBound, maxBound); });
+    return toArray(unionByDistance(stores, parts));
 }
 
-double VectorStore::l2Distance(const vector<float>& v1, const vector<float>& v2) const {
-    double sum = 0.0;
+int* ShardedVectorStore::findNearestBatch(const float* queries, int nq, DistanceMetric metric) const {
+    if (nq < 0 || (nq > 0 && !queries)) throw invalid_argument("Invalid query batch");
 
-    for (int i = 0; i < v1.size(); ++i) {
-        double diff = v1[i] - v2[i];
-        sum += diff * diff;
-    }
+    ReadGuard guard(*this);
+    const vector<VectorStore*>& stores = guard.shards();
 
-    return sqrt(sum);
-}
+    vector<vector<pair<double, int>>> nearest(stores.size());
+    fanOut([&](int shard) { nearest[shard] = stores[shard]->nearestBatchScored(queries, nq, metric); });
 
-double VectorStore::estimateD_Linear(const std::vector<float>& query, int k, double averageDistance, const std::vector<float>& reference, double c0_bias, double c1_slope) {
-    if (count == 0 || k <= 0 || k > count) {
-        return 0.0;
+    int* result = new int[nq];
+    for (int q = 0; q < nq; ++q) {
+        pair<double, int> best(0.0, -1);
+        for (const vector<pair<double, int>>& shardBest : nearest) {
+            const pair<double, int>& candidate = shardBest[q];
+            if (candidate.second < 0) continue;
+            if (best.second < 0 || betterScored(metric, candidate, best)) best = candidate;
+        }
+        result[q] = best.second;
     }
-
-    double dr = l2Distance(query, reference);
-    return abs(dr - averageDistance) + c1_slope * averageDistance * k + c0_bias;
+    return result;
 }
 
-int VectorStore::findNearest(const vector<float>& query, string metric) {
-    int nearestId = -1;
-    double bestScore = (metric == "cosine") ? -1.0 : numeric_limits<double>::max();
-    
-    auto action = [&](const VectorRecord& rec) {
-        double score = distanceByMetric(query, *(rec.vector), metric);
-        
-        bool better = false;
-        if (metric == "cosine") {
-            better = (score > bestScore);
-        } else if (metric == "Manhattan" || metric == "Euclidean"){
-            better = (score < bestScore);
+int* ShardedVectorStore::topKNearestBatch(const float* queries, int nq, int k, DistanceMetric metric) const {
+    ReadGuard guard(*this);
+    const vector<VectorStore*>& stores = guard.shards();
+
+    int total = 0;
+    for (VectorStore* shard : stores) total += shard->count;
+    if (k <= 0 || k > total) throw invalid_argument("Invalid k");
+    if (nq < 0 || (nq > 0 && !queries)) throw invalid_argument("Invalid query batch");
+
+    vector<vector<vector<pair<double, int>>>> best(stores.size());
+    fanOut([&](int shard) {
+        int shardK = min(k, stores[shard]->count);
+        if (shardK > 0) best[shard] = stores[shard]->topKBatchScored(queries, nq, shardK, metric);
+    });
+
+    auto better = [&](const pair<double, int>& a, const pair<double, int>& b) { return betterScored(metric, a, b); };
+    int* result = new int[(size_t)nq * k];
+    vector<vector<pair<double, int>>> runs(stores.size());
+    for (int q = 0; q < nq; ++q) {
+        for (size_t shard = 0; shard < stores.size(); ++shard) {
+            if (best[shard].empty()) runs[shard].clear();
+            else runs[shard].swap(best[shard][q]);
         }
-        else throw invalid_metric();
-        
-        if (better) {
-            bestScore = score;
-            nearestId = rec.id;
+
+        vector<pair<double, int>> merged = mergeSortedRuns(runs, k, better);
+        int* out = result + (size_t)q * k;
+        for (int i = 0; i < k; ++i) {
+            out[i] = merged[i].second;
         }
-    };
-    vectorStore->inorder(action);
-    
-    return nearestId;
+    }
+    return result;
 }
 
-int* VectorStore::topKNearest(const vector<float>& query, int k, string metric) {
-    if (k <= 0 || k > count) throw invalid_argument("Invalid k");
-    //if (k > count) k = count;
-
-    double normQ = 0.0;
-    for (float val : query) normQ += val * val;
-    normQ = sqrt(normQ);
+int* ShardedVectorStore::rangeQueryBatch(const float* queries, int nq, double radius, DistanceMetric metric,
+                                         vector<int>& offsets) const {
+    if (nq < 0 || (nq > 0 && !queries)) throw invalid_argument("Invalid query batch");
 
-    double D = estimateD_Linear(query, k, averageDistance, *referenceVector);
-    
-    double lower = normQ - D;
-    double upper = normQ + D;
-
-    vector<VectorRecord*> candidates;
-    
-    auto filterAction = [&](const VectorRecord& rec) {
-        double recNorm = 0.0;
-        for (float val : *(rec.vector)) recNorm += val * val;
-        recNorm = sqrt(recNorm);
+    ReadGuard guard(*this);
+    const vector<VectorStore*>& stores = guard.shards();
 
-        if (recNorm >= lower && recNorm <= upper) {
-            candidates.push_back(const_cast<VectorRecord*>(&rec));
-        }
-    };
-    
-    normIndex->inorder(filterAction);
-    
-    int m = candidates.size();
-    cout << "Value m: " << m << endl;
+    vector<vector<vector<int>>> hits(stores.size());
+    fanOut([&](int shard) { hits[shard] = stores[shard]->rangeBatchIds(queries, nq, radius, metric); });
 
-    vector<pair<double, int>> scores;
-    for(VectorRecord* rec : candidates) {
-        double score = distanceByMetric(query, *(rec->vector), metric);
-        scores.push_back({score, rec->id});
+    vector<vector<int>> perQuery(nq);
+    vector<vector<int>> parts(stores.size());
+    offsets.assign(nq + 1, 0);
+    for (int q = 0; q < nq; ++q) {
+        for (size_t shard = 0; shard < stores.size(); ++shard) parts[shard].swap(hits[shard][q]);
+        perQuery[q] = unionByDistance(stores, parts);
+        offsets[q + 1] = offsets[q] + (int)perQuery[q].size();
     }
 
-    if (metric == "cosine") {
-        for(size_t i = 0; i < scores.size(); i++) {
-            for(size_t j = i + 1; j < scores.size(); j++) {
-                if(scores[j].first > scores[i].first) {
-                    swap(scores[i], scores[j]);
-                }
-            }
-        }
-    } else if (metric == "Manhattan" || metric == "Euclidean") {
-        for(size_t i = 0; i < scores.size(); i++) {
-            for(size_t j = i + 1; j < scores.size(); j++) {
-                if(scores[j].first < scores[i].first) {
-                    swap(scores[i], scores[j]);
-                }
-            }
-        }
+    int* result = new int[offsets[nq]];
+    for (int q = 0; q < nq; ++q) {
+        copy(perQuery[q].begin(), perQuery[q].end(), result + offsets[q]);
     }
-    else throw invalid_metric();
+    return result;
+}
 
-    int resultSize = (k < (int)scores.size()) ? k : (int)scores.size();
-    int* result = new int[resultSize];
-    for (int i = 0; i < resultSize; i++) {
-        result[i] = scores[i].second;
+double ShardedVectorStore::getMaxDistance() const {
+    ReadGuard guard(*this);
+    double result = 0.0;
+    bool any = false;
+    for (VectorStore* shard : guard.shards()) {
+        if (shard->count == 0) continue;
+        result = any ? max(result, shard->getMaxDistance()) : shard->getMaxDistance();
+        any = true;
     }
-
     return result;
 }
 
-int* VectorStore::rangeQueryFromRoot(double minDist, double maxDist) const {
-    if (count == 0 || !rootVector) {
-        return new int[0];
+double ShardedVectorStore::getMinDistance() const {
+    ReadGuard guard(*this);
+    double result = 0.0;
+    bool any = false;
+    for (VectorStore* shard : guard.shards()) {
+        if (shard->count == 0) continue;
+        result = any ? min(result, shard->getMinDistance()) : shard->getMinDistance();
+        any = true;
     }
+    return result;
+}
 
-    if (minDist > maxDist) {
-        return new int[0];
+// As VectorStore::computeCentroid; each record's row comes from its shard
+VectorRecord ShardedVectorStore::computeCentroid(const std::vector<VectorRecord*>& records) const {
+    if (records.empty()) {
+        return VectorRecord(-1, "", nullptr, 0.0);
     }
 
-    vector<int> resultIds;
-    
-    auto action = [&](const VectorRecord& rec) {
-        double dist = rec.distanceFromReference;
-        if (dist >= minDist && dist <= maxDist) {
-            resultIds.push_back(rec.id);
+    ReadGuard guard(*this);
+    size_t d = shards[0]->dimension;
+    vector<float>* sumVec = new vector<float>(d, 0.0f);
+
+    for (VectorRecord* rec : records) {
+        const float* vec = getVectorData(rec);
+        for (size_t i = 0; i < d; i++) {
+            (*sumVec)[i] += vec[i];
         }
-    };
-    vectorStore->inorder(action);
+    }
 
-    int size = resultIds.size();
-    int* result = new int[size];
-    for (int i = 0; i < size; i++) {
-        result[i] = resultIds[i];
+    for (size_t i = 0; i < d; i++) {
+        (*sumVec)[i] /= records.size();
     }
 
-    return result;
+    double distToRef = l2Distance(*sumVec, *getReferenceVector());
+    return VectorRecord(-1, "centroid", sumVec, distToRef);
 }
 
-int* VectorStore::rangeQuery(const vector<float>& query, double radius, string metric) const {
-    if (count == 0) {
-        return new int[0];
-    }
+// =====================================
+// FixedVectorStore<Dim> implementation
+// =====================================
+template <int Dim>
+FixedVectorStore<Dim>::FixedVectorStore(std::vector<float>* (*embeddingFunction)(const std::string&),
+                                        const std::vector<float>& referenceVector)
+    : vectorStore(new AVLTree<IndexKey, Record>()), normIndex(new RedBlackTree<IndexKey, Record>()),
+      count(0), curId(1), averageDistance(0.0), embeddingFunction(embeddingFunction) {
+    toEmbedding(referenceVector, this->referenceVector);
+}
 
-    vector<int> resultIds;
-    
-    auto action = [&](const VectorRecord& rec) {
-        double score = distanceByMetric(query, *(rec.vector), metric);
-        
-        if (metric == "cosine") {
-            if (score >= radius) {
-                resultIds.push_back(rec.id);
-            }
-        } else if (metric == "Manhattan" || metric == "Euclidean"){
-            if (score <= radius) {
-                resultIds.push_back(rec.id);
-            }
-        }
-        else throw invalid_metric();
-    };
-    vectorStore->inorder(action);
+template <int Dim>
+FixedVectorStore<Dim>::~FixedVectorStore() {
+    this->clear();
+    delete vectorStore;
+    delete normIndex;
+}
 
-    int* result = new int[resultIds.size()];
-    for (size_t i = 0; i < resultIds.size(); i++) {
-        result[i] = resultIds[i];
-    }
+// Copies (and truncates or zero-pads) a dynamic vector into an embedding
+template <int Dim>
+void FixedVectorStore<Dim>::toEmbedding(const std::vector<float>& src, Embedding& dst) {
+    size_t n = min(src.size(), (size_t)Dim);
+    for (size_t i = 0; i < n; ++i) dst.values[i] = src[i];
+    for (size_t i = n; i < (size_t)Dim; ++i) dst.values[i] = 0.0f;
+}
 
-    return result;
+template <int Dim>
+double FixedVectorStore<Dim>::normOf(const Embedding& v) {
+    return sqrt(fixedDistanceKernels<Dim>().dot(v.values.data(), v.values.data(), Dim));
 }
 
-int* VectorStore::boundingBoxQuery(const vector<float>& minBound, const vector<float>& maxBound) const {
-    if (count == 0 || minBound.size() != maxBound.size() || minBound.empty()) {
-        return new int[0];
-    }
-    
-    for (size_t i = 0; i < minBound.size(); i++) {
-        if (minBound[i] > maxBound[i]) {
-            return new int[0];
-        }
-    }
-    
-    vector<int> ids;
-    
-    auto action = [&](const VectorRecord& rec) {
-        const vector<float>& v = *(rec.vector);
-        bool inside = true;
-
-        for (size_t i = 0; i < v.size() && i < minBound.size(); i++) {
-            if (v[i] < minBound[i] || v[i] > maxBound[i]) {
-                inside = false;
-                break;
-            }
-        }
-        
-        if (inside) {
-            ids.push_back(rec.id);
-        }
-    };
-    vectorStore->inorder(action);
+template <int Dim>
+void FixedVectorStore<Dim>::clear() {
+    // normIndex holds every record, so it owns the embeddings
+    normIndex->inorder([](const Record& rec) {
+        delete rec.vector;
+    });
+    vectorStore->clear();
+    normIndex->clear();
+    count = 0;
+    curId = 1;
+    averageDistance = 0.0;
+}
 
-    int* result = new int[ids.size()];
-    for (size_t i = 0; i < ids.size(); i++) {
-        result[i] = ids[i];
-    }
-    return result;
+template <int Dim>
+void FixedVectorStore<Dim>::addText(const std::string& rawText) {
+    std::vector<float>* raw = embeddingFunction(rawText);
+    Embedding* vec = new Embedding();
+    toEmbedding(*raw, *vec);
+    delete raw;
+
+    const DistanceKernels& kernels = fixedDistanceKernels<Dim>();
+    double distance = sqrt(kernels.squaredL2(vec->values.data(), referenceVector.values.data(), Dim));
+    double norm = normOf(*vec);
+
+    Record record(curId++, rawText, vec, distance, norm);
+    vectorStore->insert(IndexKey(distance, record.id), record);
+    normIndex->insert(IndexKey(norm, record.id), record);
+
+    averageDistance = (averageDistance * count + distance) / (count + 1);
+    ++count;
 }
 
-double VectorStore::getMaxDistance() const {
-	if (count == 0 || !rootVector)  return 0.0;
+template <int Dim>
+typename FixedVectorStore<Dim>::Record* FixedVectorStore<Dim>::getVector(int index) {
+    if (index < 0 || index >= count) throw out_of_range("Index is invalid!");
 
-    double maxDist = 0;
-    auto action = [&maxDist](const VectorRecord& r) {
-        if (r.distanceFromReference > maxDist) maxDist = r.distanceFromReference;
-    };
+    typename AVLTree<IndexKey, Record>::AVLNode* node = vectorStore->select(index);
+    if (!node) throw out_of_range("Index is invalid!");
 
-    vectorStore->inorder(action);
-    return maxDist;
+    return &node->data();
 }
 
-double VectorStore::getMinDistance() const {
-	return vectorStore->minNode(vectorStore->getRoot())->key;
+template <int Dim>
+bool FixedVectorStore<Dim>::removeAt(int index) {
+    Record* removed = getVector(index);
+    int removedId = removed->id;
+    double removedDist = removed->distanceFromReference;
+    double removedNorm = removed->norm;
+    Embedding* removedVector = removed->vector;
+
+    vectorStore->remove(IndexKey(removedDist, removedId));
+    normIndex->remove(IndexKey(removedNorm, removedId));
+    delete removedVector;
 
+    --count;
+    averageDistance = (count == 0) ? 0.0 : (averageDistance * (count + 1) - removedDist) / count;
+    return true;
 }
 
-VectorRecord VectorStore::computeCentroid(const std::vector<VectorRecord*>& records) const {
-	if (records.empty()) {
-		return VectorRecord(-1, "", nullptr, 0.0);
-	}
+template <int Dim>
+template <DistanceMetric M>
+vector<pair<double, int>> FixedVectorStore<Dim>::topKImpl(const Embedding& query, const vector<Record*>& candidates, int k) const {
+    const DistanceKernels& kernels = fixedDistanceKernels<Dim>();
+    double normQ = queryNorm<M>(kernels, query.values.data(), Dim);
 
-	size_t d = dimension;
-	vector<float>* sumVec = new vector<float>(d, 0.0f);
+    vector<pair<double, int>> scores;
+    scores.reserve(candidates.size());
+    for (Record* rec : candidates) {
+        double score = MetricTraits<M>::score(kernels, query.values.data(), rec->vector->values.data(), Dim, normQ, rec->norm);
+        scores.push_back({score, rec->id});
+    }
 
-	for (VectorRecord* rec : records) {
-		const vector<float>& vec = *(rec->vector);
-		for (size_t i = 0; i < d; i++) {
-			(*sumVec)[i] += vec[i];
-		}
-	}
+    auto better = [](const pair<double, int>& a, const pair<double, int>& b) {
+        if (a.first != b.first) return MetricTraits<M>::better(a.first, b.first);
+        return a.second < b.second;
+    };
 
-	for (size_t i = 0; i < d; i++) {
-		(*sumVec)[i] /= records.size();
-	}
+    int resultSize = (k < (int)scores.size()) ? k : (int)scores.size();
+    partial_sort(scores.begin(), scores.begin() + resultSize, scores.end(), better);
+    scores.resize(resultSize);
 
-	double distToRef = l2Distance(*sumVec, *referenceVector);
-	return VectorRecord(-1, "centroid", sumVec, distToRef);
+    return scores;
 }
 
-VectorRecord* VectorStore::findVectorNearestToDistance(double targetDistance) const {
-	if (count == 0) {
-		return nullptr;
-	}
+// Same norm-window candidate selection as VectorStore::topKNearest
+template <int Dim>
+int* FixedVectorStore<Dim>::topKNearest(const std::vector<float>& query, int k, DistanceMetric metric) {
+    if (k <= 0 || k > count) throw invalid_argument("Invalid k");
 
-	VectorRecord* bestRecord = nullptr;
-	double minDiff = numeric_limits<double>::max();
+    Embedding q;
+    toEmbedding(query, q);
 
-	auto action = [&](const VectorRecord& rec) {
-		double diff = abs(rec.distanceFromReference - targetDistance);
-		if (diff < minDiff) {
-			minDiff = diff;
-			bestRecord = const_cast<VectorRecord*>(&rec);
-		}
-	};
-	vectorStore->inorder(action);
+    const DistanceKernels& kernels = fixedDistanceKernels<Dim>();
+    double normQ = normOf(q);
+    double dr = sqrt(kernels.squaredL2(q.values.data(), referenceVector.values.data(), Dim));
+    double D = abs(dr - averageDistance) + 0.05 * averageDistance * k + 1e-9;
+
+    vector<Record*> candidates;
+    typename RedBlackTree<IndexKey, Record>::Iterator it = normIndex->lowerBound(IndexKey::lowest(normQ - D));
+    typename RedBlackTree<IndexKey, Record>::Iterator last = normIndex->upperBound(IndexKey::highest(normQ + D));
+    for (; it != last; ++it) {
+        candidates.push_back(&*it);
+    }
+
+    vector<pair<double, int>> best;
+    switch (metric) {
+        case COSINE:    best = topKImpl<COSINE>(q, candidates, k); break;
+        case EUCLIDEAN: best = topKImpl<EUCLIDEAN>(q, candidates, k); break;
+        case MANHATTAN: best = topKImpl<MANHATTAN>(q, candidates, k); break;
+    }
+
+    int* result = new int[best.size()];
+    for (size_t i = 0; i < best.size(); i++) {
+        result[i] = best[i].second;
+    }
+    return result;
+}
+
+template <int Dim>
+template <DistanceMetric M>
+vector<int> FixedVectorStore<Dim>::rangeQueryImpl(const Embedding& query, double radius) const {
+    const DistanceKernels& kernels = fixedDistanceKernels<Dim>();
+    double normQ = queryNorm<M>(kernels, query.values.data(), Dim);
+
+    vector<int> resultIds;
+    vectorStore->inorder([&](const Record& rec) {
+        double score = MetricTraits<M>::score(kernels, query.values.data(), rec.vector->values.data(), Dim, normQ, rec.norm);
+        if (MetricTraits<M>::within(score, radius)) {
+            resultIds.push_back(rec.id);
+        }
+    });
+    return resultIds;
+}
+
+template <int Dim>
+int* FixedVectorStore<Dim>::rangeQuery(const std::vector<float>& query, double radius, DistanceMetric metric) const {
+    Embedding q;
+    toEmbedding(query, q);
+
+    vector<int> resultIds;
+    switch (metric) {
+        case COSINE:    resultIds = rangeQueryImpl<COSINE>(q, radius); break;
+        case EUCLIDEAN: resultIds = rangeQueryImpl<EUCLIDEAN>(q, radius); break;
+        case MANHATTAN: resultIds = rangeQueryImpl<MANHATTAN>(q, radius); break;
+    }
 
-	return bestRecord;
+    int* result = new int[resultIds.size()];
+    for (size_t i = 0; i < resultIds.size(); i++) {
+        result[i] = resultIds[i];
+    }
+    return result;
 }
 
 //TODO: Implement all VectorStore methods here
 
 // Explicit template instantiation for the type used by VectorStore
 template class AVLTree<double, VectorRecord>;
+template class AVLTree<IndexKey, int>;
 template class AVLTree<double, double>;
 template class AVLTree<int, double>;
 template class AVLTree<int, int>;
@@ -1442,11 +4745,27 @@ template class AVLTree<double, string>;
 template class AVLTree<int, string>;
 
 template class RedBlackTree<double, VectorRecord>;
+template class RedBlackTree<IndexKey, int>;
 template class RedBlackTree<double, double>;
 template class RedBlackTree<int, double>;
 template class RedBlackTree<int, int>;
 template class RedBlackTree<double, string>;
 template class RedBlackTree<int, string>;
 
+template class BPlusTree<IndexKey, int>;
+template class BPlusTree<double, double>;
+template class BPlusTree<int, int>;
+template class BPlusTree<double, string>;
+template class BPlusTree<int, string>;
+
+template class EytzingerIndex<IndexKey, int>;
+template class EytzingerIndex<double, double>;
+template class EytzingerIndex<int, int>;
+
+template class FixedVectorStore<384>;
+template class FixedVectorStore<768>;
+template class FixedVectorStore<1024>;
+template class FixedVectorStore<1536>;
+
 
 
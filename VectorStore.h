@@ -14,6 +14,200 @@ enum BalanceValue {
     RH = 1   // Right Higher
 };
 
+// ------------------------------
+// Node allocators
+// ------------------------------
+// Interface used by the tree templates to obtain node storage. A tree
+// made without one owns a SlabNodeAllocator; one passed to a tree's
+// constructor stays the caller's and may serve several trees.
+class NodeAllocator {
+    public:
+        virtual ~NodeAllocator() {}
+
+        virtual void* allocate(size_t bytes) = 0;
+        virtual void deallocate(void* block, size_t bytes) = 0;
+
+        // True if releaseAll() can drop every outstanding block at once
+        virtual bool supportsReleaseAll() const { return false; }
+        virtual void releaseAll() {}
+};
+
+// Plain operator new / delete for every node
+class HeapNodeAllocator : public NodeAllocator {
+    public:
+        void* allocate(size_t bytes) override;
+        void deallocate(void* block, size_t bytes) override;
+};
+
+// Size-class slab allocator. Blocks are carved out of large slabs and
+// recycled through one free list per size class; releaseAll() returns
+// every slab in a single pass.
+class SlabNodeAllocator : public NodeAllocator {
+    private:
+        static const size_t GRANULARITY = 16;
+        static const size_t CLASS_COUNT = 64;           // classes of 16..1024 bytes
+        static const size_t SLAB_BYTES = 64 * 1024;
+
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        // Blocks larger than the biggest class are allocated on their own
+        // and chained so releaseAll() can still find them
+        struct LargeBlock {
+            LargeBlock* prev;
+            LargeBlock* next;
+        };
+        static const size_t LARGE_HEADER = (sizeof(LargeBlock) + GRANULARITY - 1) / GRANULARITY * GRANULARITY;
+
+        FreeBlock* freeLists[CLASS_COUNT];
+        char* bumpBegin[CLASS_COUNT];
+        char* bumpEnd[CLASS_COUNT];
+        std::vector<void*> slabs;
+        LargeBlock* largeBlocks;
+
+        static size_t sizeClass(size_t bytes) { return (bytes + GRANULARITY - 1) / GRANULARITY - 1; }
+
+    public:
+        SlabNodeAllocator();
+        ~SlabNodeAllocator();
+
+        void* allocate(size_t bytes) override;
+        void deallocate(void* block, size_t bytes) override;
+
+        bool supportsReleaseAll() const override { return true; }
+        void releaseAll() override;
+};
+
+// ------------------------------
+// Node payload storage
+// ------------------------------
+// Tree nodes keep what a descent reads (key, links, balance or colour)
+// together and move the payload T out of line, so walking down a tree only
+// pulls the small hot part of each node into cache. Payloads no larger than
+// a pointer stay inline; the indirection would cost more than it saves.
+// Building with TREE_INLINE_PAYLOADS keeps every payload inline, the old
+// layout, for comparison (./main nodes).
+#if defined(TREE_INLINE_PAYLOADS)
+template <class T, bool Inline = true>
+#else
+template <class T, bool Inline = (sizeof(T) <= sizeof(void*))>
+#endif
+class NodePayload;
+
+template <class T>
+class NodePayload<T, true> {
+    private:
+        T value;
+
+    public:
+        // The allocator is not touched, so nodes can be built concurrently
+        static const bool USES_ALLOCATOR = false;
+
+        NodePayload(const T& value, NodeAllocator*) : value(value) {}
+        NodePayload(const NodePayload&) = delete;
+        NodePayload& operator=(const NodePayload&) = delete;
+
+        T& get() { return value; }
+        const T& get() const { return value; }
+        void swap(NodePayload& other) { std::swap(value, other.value); }
+        void destroy(NodeAllocator*, bool) {}
+};
+
+template <class T>
+class NodePayload<T, false> {
+    private:
+        T* value;
+
+    public:
+        static const bool USES_ALLOCATOR = true;
+
+        NodePayload(const T& value, NodeAllocator* allocator)
+            : value(new (allocator->allocate(sizeof(T))) T(value)) {}
+        NodePayload(const NodePayload&) = delete;
+        NodePayload& operator=(const NodePayload&) = delete;
+
+        T& get() { return *value; }
+        const T& get() const { return *value; }
+        void swap(NodePayload& other) { std::swap(value, other.value); }
+        // With releaseStorage == false the allocator is released in bulk later
+        void destroy(NodeAllocator* allocator, bool releaseStorage) {
+            value->~T();
+            if (releaseStorage) allocator->deallocate(value, sizeof(T));
+        }
+};
+
+// Fetches a child into cache while the current node is being compared;
+// TREE_NO_PREFETCH turns it off for comparison
+#if defined(__GNUC__) && !defined(TREE_NO_PREFETCH)
+#define TREE_PREFETCH(node) __builtin_prefetch(node)
+#else
+#define TREE_PREFETCH(node) ((void)0)
+#endif
+
+// ------------------------------
+// WorkStealingScheduler
+// ------------------------------
+// Fork-join scheduler for recursive jobs such as index rebuilds. Each
+// worker owns a deque: it pushes and pops its spawned tasks at the back
+// and, once empty, steals from the front of a randomly chosen victim.
+// Outside run(), spawn() simply calls the task.
+class WorkStealingScheduler {
+    public:
+        // Tracks the unfinished tasks spawned into it
+        class TaskGroup {
+            friend class WorkStealingScheduler;
+            private:
+                std::atomic<int> pending;
+            public:
+                TaskGroup() : pending(0) {}
+        };
+
+    private:
+        struct Task {
+            std::function<void()> fn;
+            TaskGroup* group;
+        };
+
+        struct WorkerQueue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::thread> workers;
+        std::deque<WorkerQueue> queues;         // queues[0] is the thread inside run()
+        std::mutex mutex;
+        std::mutex submitMutex;
+        std::condition_variable wake;
+        std::atomic<bool> active;
+        std::atomic<bool> stopping;
+
+        void workerLoop(int index);
+        // Runs one task from the worker's own deque or a stolen one
+        bool runOne(int index, unsigned& seed);
+
+    public:
+        explicit WorkStealingScheduler(int threads);
+        ~WorkStealingScheduler();
+
+        WorkStealingScheduler(const WorkStealingScheduler&) = delete;
+        WorkStealingScheduler& operator=(const WorkStealingScheduler&) = delete;
+
+        int size() const { return (int)queues.size(); }
+
+        // Runs job on the calling thread while the workers take whatever it
+        // spawns. A caller that finds the scheduler busy runs job with every
+        // spawn inline.
+        void run(const std::function<void()>& job);
+        // Every spawn must be matched by a wait on its group
+        void spawn(TaskGroup& group, std::function<void()> task);
+        // Works on queued or stolen tasks until all of group has finished
+        void wait(TaskGroup& group);
+};
+
+// Subtrees smaller than this are built by a single task
+static const int PARALLEL_BUILD_GRAIN = 8192;
+
 // ------------------------------
 // Generic AVL Tree (template)
 // ------------------------------
@@ -25,40 +219,132 @@ class AVLTree {
         class AVLNode {
         public:
             K key;
-            T data;
             AVLNode* pLeft;
             AVLNode* pRight;
             BalanceValue balance;
+            int height; // height of the subtree rooted here (leaf = 1)
+            int size;   // number of nodes in the subtree rooted here
+            NodePayload<T> payload;
 
-            AVLNode(const K& key, const T& value)
-                : key(key), data(value), pLeft(nullptr), pRight(nullptr), balance(EH) {}
+            AVLNode(const K& key, const T& value, NodeAllocator* allocator)
+                : key(key), pLeft(nullptr), pRight(nullptr), balance(EH), height(1), size(1), payload(value, allocator) {}
+
+            T& data() { return payload.get(); }
+            const T& data() const { return payload.get(); }
             friend class VectorStore; // Allow VectorStore to access AVLNode members
         };
 
+        // Bidirectional in-order iterator. AVLNode has no parent pointer, so
+        // the iterator keeps the root-to-current path; end() is an empty path.
+        class Iterator {
+        private:
+            AVLNode* root;
+            std::vector<AVLNode*> path;
+
+            friend class AVLTree;
+
+            void pushLeftmost(AVLNode* node) {
+                for (; node; node = node->pLeft) path.push_back(node);
+            }
+
+            void pushRightmost(AVLNode* node) {
+                for (; node; node = node->pRight) path.push_back(node);
+            }
+
+        public:
+            Iterator() : root(nullptr) {}
+            explicit Iterator(AVLNode* root) : root(root) {}
+
+            AVLNode* node() const { return path.empty() ? nullptr : path.back(); }
+            const K& key() const { return path.back()->key; }
+            T& operator*() const { return path.back()->data(); }
+            T* operator->() const { return &path.back()->data(); }
+
+            Iterator& operator++() {
+                AVLNode* current = path.back();
+                if (current->pRight) {
+                    pushLeftmost(current->pRight);
+                    return *this;
+                }
+                path.pop_back();
+                while (!path.empty() && path.back()->pRight == current) {
+                    current = path.back();
+                    path.pop_back();
+                }
+                return *this;
+            }
+
+            // Decrementing end() moves to the largest key
+            Iterator& operator--() {
+                if (path.empty()) {
+                    pushRightmost(root);
+                    return *this;
+                }
+                AVLNode* current = path.back();
+                if (current->pLeft) {
+                    pushRightmost(current->pLeft);
+                    return *this;
+                }
+                path.pop_back();
+                while (!path.empty() && path.back()->pLeft == current) {
+                    current = path.back();
+                    path.pop_back();
+                }
+                return *this;
+            }
+
+            bool operator==(const Iterator& other) const { return node() == other.node(); }
+            bool operator!=(const Iterator& other) const { return node() != other.node(); }
+        };
+
     protected:
         AVLNode* root;
+        NodeAllocator* allocator;
+        bool ownsAllocator;
+
+        AVLNode* createNode(const K& key, const T& value);
+        void destroyNode(AVLNode* node);
 
         AVLNode* rotateRight(AVLNode*& node);
         AVLNode* rotateLeft(AVLNode*& node);
-        int height(AVLNode* node);
-        BalanceValue getBalance(AVLNode* node);
+        static int height(AVLNode* node) { return node ? node->height : 0; }
+        static int getBalance(AVLNode* node);
+        static int nodeSize(AVLNode* node) { return node ? node->size : 0; }
+        static void updateNode(AVLNode* node);
 
-        void clearHelper(AVLNode* node);
+        void clearHelper(AVLNode* node, bool releaseStorage);
 
 
     public:
         AVLTree()
-            : root(nullptr) {}
+            : root(nullptr), allocator(new SlabNodeAllocator()), ownsAllocator(true) {}
+        // Nodes, and payloads too wide to sit inline, come from allocator
+        explicit AVLTree(NodeAllocator* allocator)
+            : root(nullptr), allocator(allocator), ownsAllocator(false) {}
         ~AVLTree() {
 			this->clear();
+			if (ownsAllocator) delete allocator;
 		};
         void insert(const K& key, const T& value);
         AVLNode* insertHelper(AVLNode* node, const K& key, const T& value);
         AVLNode* minNode(AVLNode* node);
+        AVLNode* maxNode(AVLNode* node);
         void remove(const K& key);
         AVLNode* removeHelper(AVLNode* node, const K& key);
         bool contains(const K& key) const;
 
+        // Order statistics (0-based, in key order)
+        AVLNode* select(int index) const;
+        int rank(const K& key) const;
+
+        Iterator begin() const;
+        Iterator end() const { return Iterator(this->root); }
+        Iterator lowerBound(const K& key) const; // first key >= key
+        Iterator upperBound(const K& key) const; // first key > key
+        Iterator floor(const K& key) const;      // last key <= key
+        Iterator ceiling(const K& key) const { return lowerBound(key); }
+        Iterator last() const;                   // largest key
+
         int getHeight() const;
         int getSize() const;
         bool empty() const;
@@ -73,7 +359,7 @@ class AVLTree {
 		void inorderHelper(AVLNode* node, Func& f) {
 			if (!node) return ;
 			inorderHelper(node->pLeft, f);
-			f(node->data);
+			f(node->data());
 			inorderHelper(node->pRight, f);
 		}
 
@@ -81,6 +367,65 @@ class AVLTree {
 		void inorder(Func f) {
 			inorderHelper(this->root, f);
 		}
+
+		// Only descends into subtrees that can hold keys in [lo, hi]
+		template <typename Func>
+		void rangeHelper(AVLNode* node, const K& lo, const K& hi, Func& f) {
+			if (!node) return ;
+			if (lo < node->key) rangeHelper(node->pLeft, lo, hi, f);
+			if (!(node->key < lo) && !(hi < node->key)) f(node->data());
+			if (node->key < hi) rangeHelper(node->pRight, lo, hi, f);
+		}
+
+		// Calls f on the data of every key in [lo, hi], in key order: O(log n + k)
+		template <typename Func>
+		void rangeVisit(const K& lo, const K& hi, Func f) {
+			rangeHelper(this->root, lo, hi, f);
+		}
+
+		// Replaces the contents with the (key, value) pairs in [begin, end),
+		// which must be sorted by key. Runs in O(n); as with insert, only the
+		// first of several equal keys is kept.
+		// With a scheduler, subtrees are built as parallel tasks; the node
+		// blocks are then taken from the allocator up front, in key order.
+		template <typename Iter>
+		void buildFromSorted(Iter begin, Iter end, WorkStealingScheduler* scheduler = nullptr) {
+			this->clear();
+
+			std::vector<Iter> items;
+			for (Iter it = begin; it != end; ++it) {
+				if (!items.empty() && !(items.back()->first < it->first)) continue;
+				items.push_back(it);
+			}
+
+			std::vector<void*> blocks;
+			if (scheduler && !NodePayload<T>::USES_ALLOCATOR && (int)items.size() >= PARALLEL_BUILD_GRAIN) {
+				blocks.resize(items.size());
+				for (void*& block : blocks) block = allocator->allocate(sizeof(AVLNode));
+			}
+			this->root = buildHelper(items, 0, (int)items.size(), blocks.empty() ? nullptr : scheduler, blocks.data());
+		}
+
+		template <typename Iter>
+		AVLNode* buildHelper(const std::vector<Iter>& items, int lo, int hi,
+		                     WorkStealingScheduler* scheduler = nullptr, void** blocks = nullptr) {
+			if (lo >= hi) return nullptr;
+
+			int mid = lo + (hi - lo) / 2;
+			AVLNode* node = blocks ? new (blocks[mid]) AVLNode(items[mid]->first, items[mid]->second, allocator)
+			                       : createNode(items[mid]->first, items[mid]->second);
+			if (scheduler && hi - lo >= PARALLEL_BUILD_GRAIN) {
+				WorkStealingScheduler::TaskGroup group;
+				scheduler->spawn(group, [&] { node->pLeft = buildHelper(items, lo, mid, scheduler, blocks); });
+				node->pRight = buildHelper(items, mid + 1, hi, scheduler, blocks);
+				scheduler->wait(group);
+			} else {
+				node->pLeft = buildHelper(items, lo, mid, nullptr, blocks);
+				node->pRight = buildHelper(items, mid + 1, hi, nullptr, blocks);
+			}
+			updateNode(node);
+			return node;
+		}
 		
         AVLNode* getRoot() const { return root; }
 };
@@ -98,15 +443,18 @@ public:
 class RBTNode {
     public:
         K key;
-        T data;
         Color color;
         RBTNode* parent;
         RBTNode* left;
         RBTNode* right;
+        NodePayload<T> payload;
 
         // Constructor
-        RBTNode(const K& key, const T& value)
-            : key(key), data(value), color(RED), parent(nullptr), left(nullptr), right(nullptr) {}
+        RBTNode(const K& key, const T& value, NodeAllocator* allocator)
+            : key(key), color(RED), parent(nullptr), left(nullptr), right(nullptr), payload(value, allocator) {}
+
+        T& data() { return payload.get(); }
+        const T& data() const { return payload.get(); }
         
         void recolorToRed();
         void recolorToBlack();
@@ -114,14 +462,75 @@ class RBTNode {
         friend class VectorStore; // Allow VectorStore to access RBTNode members
     };
 
+    // Bidirectional in-order iterator stepping through parent pointers;
+    // end() holds a null node.
+    class Iterator {
+    private:
+        const RedBlackTree* tree;
+        RBTNode* current;
+
+    public:
+        Iterator() : tree(nullptr), current(nullptr) {}
+        Iterator(const RedBlackTree* tree, RBTNode* node) : tree(tree), current(node) {}
+
+        RBTNode* node() const { return current; }
+        const K& key() const { return current->key; }
+        T& operator*() const { return current->data(); }
+        T* operator->() const { return &current->data(); }
+
+        Iterator& operator++() {
+            if (current->right) {
+                current = current->right;
+                while (current->left) current = current->left;
+                return *this;
+            }
+            RBTNode* parent = current->parent;
+            while (parent && current == parent->right) {
+                current = parent;
+                parent = parent->parent;
+            }
+            current = parent;
+            return *this;
+        }
+
+        // Decrementing end() moves to the largest key
+        Iterator& operator--() {
+            if (!current) {
+                current = tree->root;
+                while (current && current->right) current = current->right;
+                return *this;
+            }
+            if (current->left) {
+                current = current->left;
+                while (current->right) current = current->right;
+                return *this;
+            }
+            RBTNode* parent = current->parent;
+            while (parent && current == parent->left) {
+                current = parent;
+                parent = parent->parent;
+            }
+            current = parent;
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const { return current == other.current; }
+        bool operator!=(const Iterator& other) const { return current != other.current; }
+    };
+
 private:
     RBTNode* root;
+    NodeAllocator* allocator;
+    bool ownsAllocator;
 
 protected:
+    RBTNode* createNode(const K& key, const T& value);
+    void destroyNode(RBTNode* node);
+
     void rotateLeft(RBTNode* node);
     void rotateRight(RBTNode* node);
 
-	void clearHelper(RBTNode* node);
+	void clearHelper(RBTNode* node, bool releaseStorage);
 
     bool isRed(RBTNode* node);
     void fixInsert(RBTNode* node);
@@ -133,9 +542,13 @@ protected:
 
 public:
     RedBlackTree()
-        : root(nullptr) {}
+        : root(nullptr), allocator(new SlabNodeAllocator()), ownsAllocator(true) {}
+    // clear() then frees node by node instead of through releaseAll()
+    explicit RedBlackTree(NodeAllocator* allocator)
+        : root(nullptr), allocator(allocator), ownsAllocator(false) {}
     ~RedBlackTree() {
         this->clear();
+        if (ownsAllocator) delete allocator;
     }
     
     bool empty() const;
@@ -150,11 +563,16 @@ public:
     RBTNode* lowerBound(const K& key, bool& found) const;
     RBTNode* upperBound(const K& key, bool& found) const;
 
+    Iterator begin() const;
+    Iterator end() const { return Iterator(this, nullptr); }
+    Iterator lowerBound(const K& key) const { return Iterator(this, lowerBoundNode(key)); } // first key >= key
+    Iterator upperBound(const K& key) const { return Iterator(this, upperBoundNode(key)); } // first key > key
+
     template <typename Func>
     void inorderHelper(RBTNode* node, Func& f) {
         if (!node) return ;
         inorderHelper(node->left, f);
-        f(node->data);
+        f(node->data());
         inorderHelper(node->right, f);
     }
 
@@ -163,10 +581,618 @@ public:
         inorderHelper(this->root, f);
     }
 
+    // Replaces the contents with the (key, value) pairs in the random-access
+    // range [begin, end), which must be sorted by key. Runs in O(n): the
+    // tree is built perfectly balanced, every complete level is black and
+    // the nodes of the last, partial level (if any) are red.
+    // A scheduler builds subtrees in parallel, as in AVLTree::buildFromSorted
+    template <typename Iter>
+    void buildFromSorted(Iter begin, Iter end, WorkStealingScheduler* scheduler = nullptr) {
+        this->clear();
+
+        int n = (int)(end - begin);
+        int redDepth = 0;
+        while ((2 << redDepth) - 1 <= n) ++redDepth;
+
+        std::vector<void*> blocks;
+        if (scheduler && !NodePayload<T>::USES_ALLOCATOR && n >= PARALLEL_BUILD_GRAIN) {
+            blocks.resize(n);
+            for (void*& block : blocks) block = allocator->allocate(sizeof(RBTNode));
+        }
+        this->root = buildHelper(begin, 0, n, 0, redDepth, nullptr, blocks.empty() ? nullptr : scheduler, blocks.data());
+    }
+
+    template <typename Iter>
+    RBTNode* buildHelper(Iter begin, int lo, int hi, int depth, int redDepth, RBTNode* parent,
+                         WorkStealingScheduler* scheduler = nullptr, void** blocks = nullptr) {
+        if (lo >= hi) return nullptr;
+
+        int mid = lo + (hi - lo) / 2;
+        RBTNode* node = blocks ? new (blocks[mid]) RBTNode(begin[mid].first, begin[mid].second, allocator)
+                               : createNode(begin[mid].first, begin[mid].second);
+        node->color = (depth == redDepth) ? RED : BLACK;
+        node->parent = parent;
+        if (scheduler && hi - lo >= PARALLEL_BUILD_GRAIN) {
+            WorkStealingScheduler::TaskGroup group;
+            scheduler->spawn(group, [&] { node->left = buildHelper(begin, lo, mid, depth + 1, redDepth, node, scheduler, blocks); });
+            node->right = buildHelper(begin, mid + 1, hi, depth + 1, redDepth, node, scheduler, blocks);
+            scheduler->wait(group);
+        } else {
+            node->left = buildHelper(begin, lo, mid, depth + 1, redDepth, node, nullptr, blocks);
+            node->right = buildHelper(begin, mid + 1, hi, depth + 1, redDepth, node, nullptr, blocks);
+        }
+        return node;
+    }
+
     void printTreeStructure() const;
 };
 
 
+// ------------------------------
+// B+ tree (template)
+// ------------------------------
+// Alternative to AVLTree with the same surface. Entries live only in the
+// leaves, which are linked both ways, so ordered scans run along flat key
+// arrays; inner nodes hold a few cache lines of separator keys plus the
+// entry count below each child for select(). Keys are unique, as in AVLTree.
+template <class K, class T>
+class BPlusTree {
+    friend class VectorStore; // Allow VectorStore to access protected/private members
+
+    public:
+        // Separator keys of an inner node fill four cache lines
+        static const int INNER_CAPACITY = (4 * 64 / sizeof(K)) < 4 ? 4 : (4 * 64 / sizeof(K));
+        static const int LEAF_CAPACITY = (8 * 64 / (sizeof(K) + sizeof(T))) < 4 ? 4 : (8 * 64 / (sizeof(K) + sizeof(T)));
+        static const int INNER_MIN = INNER_CAPACITY / 2;
+        static const int LEAF_MIN = LEAF_CAPACITY / 2;
+
+        class Node {
+        public:
+            bool isLeaf;
+            int count; // keys held by this node
+
+            explicit Node(bool isLeaf) : isLeaf(isLeaf), count(0) {}
+        };
+
+        class Leaf : public Node {
+        public:
+            K keys[LEAF_CAPACITY];
+            T values[LEAF_CAPACITY];
+            Leaf* prev;
+            Leaf* next;
+
+            Leaf() : Node(true), prev(nullptr), next(nullptr) {}
+        };
+
+        // children[i] holds the keys in [keys[i - 1], keys[i])
+        class Inner : public Node {
+        public:
+            K keys[INNER_CAPACITY];
+            Node* children[INNER_CAPACITY + 1];
+            int sizes[INNER_CAPACITY + 1]; // entries below each child
+
+            Inner() : Node(false) {}
+        };
+
+        // Bidirectional iterator over (leaf, position); end() has no leaf
+        class Iterator {
+        private:
+            const BPlusTree* tree;
+            Leaf* leaf;
+            int pos;
+
+            friend class BPlusTree;
+
+        public:
+            Iterator() : tree(nullptr), leaf(nullptr), pos(0) {}
+            Iterator(const BPlusTree* tree, Leaf* leaf, int pos) : tree(tree), leaf(leaf), pos(pos) {}
+
+            const K& key() const { return leaf->keys[pos]; }
+            T& operator*() const { return leaf->values[pos]; }
+            T* operator->() const { return &leaf->values[pos]; }
+
+            Iterator& operator++() {
+                if (++pos == leaf->count) {
+                    leaf = leaf->next;
+                    pos = 0;
+                }
+                return *this;
+            }
+
+            // Decrementing end() moves to the largest key
+            Iterator& operator--() {
+                if (!leaf) {
+                    leaf = tree->tail;
+                    pos = leaf ? leaf->count - 1 : 0;
+                } else if (pos > 0) {
+                    --pos;
+                } else {
+                    leaf = leaf->prev;
+                    pos = leaf ? leaf->count - 1 : 0;
+                }
+                return *this;
+            }
+
+            bool operator==(const Iterator& other) const { return leaf == other.leaf && pos == other.pos; }
+            bool operator!=(const Iterator& other) const { return !(*this == other); }
+        };
+
+    protected:
+        Node* root;
+        Leaf* head;
+        Leaf* tail;
+        int entryCount;
+
+        static int subtreeSize(Node* node);
+        static int childIndex(const Inner* node, const K& key);
+        Leaf* findLeaf(const K& key) const;
+
+        bool insertHelper(Node* node, const K& key, const T& value, K& splitKey, Node*& splitNode);
+        bool removeHelper(Node* node, const K& key);
+        void rebalanceChild(Inner* parent, int index);
+        void mergeChildren(Inner* parent, int index);
+        void clearHelper(Node* node, bool releaseStorage);
+
+        NodeAllocator* allocator;
+        bool ownsAllocator;
+
+        Leaf* createLeaf();
+        Inner* createInner();
+        void destroyNode(Node* node);
+
+    public:
+        BPlusTree()
+            : root(nullptr), head(nullptr), tail(nullptr), entryCount(0), allocator(new SlabNodeAllocator()), ownsAllocator(true) {}
+        // Leaves and inner nodes are two block sizes of allocator
+        explicit BPlusTree(NodeAllocator* allocator)
+            : root(nullptr), head(nullptr), tail(nullptr), entryCount(0), allocator(allocator), ownsAllocator(false) {}
+        ~BPlusTree() {
+            this->clear();
+            if (ownsAllocator) delete allocator;
+        }
+
+        BPlusTree(const BPlusTree&) = delete;
+        BPlusTree& operator=(const BPlusTree&) = delete;
+
+        void insert(const K& key, const T& value);
+        void remove(const K& key);
+        bool contains(const K& key) const;
+
+        // Order statistics (0-based, in key order)
+        Iterator select(int index) const;
+        int rank(const K& key) const;             // number of keys < key
+
+        Iterator begin() const { return Iterator(this, head, 0); }
+        Iterator end() const { return Iterator(this, nullptr, 0); }
+        Iterator lowerBound(const K& key) const; // first key >= key
+        Iterator upperBound(const K& key) const; // first key > key
+        Iterator floor(const K& key) const;      // last key <= key
+        Iterator ceiling(const K& key) const { return lowerBound(key); }
+        Iterator last() const { return Iterator(this, tail, tail ? tail->count - 1 : 0); }
+
+        int getHeight() const;
+        int getSize() const { return entryCount; }
+        bool empty() const { return entryCount == 0; }
+        void clear();
+
+        template <typename Func>
+        void inorder(Func f) {
+            for (Leaf* leaf = head; leaf; leaf = leaf->next) {
+                for (int i = 0; i < leaf->count; ++i) f(leaf->values[i]);
+            }
+        }
+
+        // Calls f on the data of every key in [lo, hi], in key order, walking
+        // the leaf chain from the first match
+        template <typename Func>
+        void rangeVisit(const K& lo, const K& hi, Func f) {
+            Iterator it = lowerBound(lo);
+            Leaf* leaf = it.leaf;
+            int i = it.pos;
+            for (; leaf; leaf = leaf->next, i = 0) {
+                for (; i < leaf->count; ++i) {
+                    if (hi < leaf->keys[i]) return;
+                    f(leaf->values[i]);
+                }
+            }
+        }
+
+        // Replaces the contents with the (key, value) pairs in [begin, end),
+        // which must be sorted by key, packing the nodes level by level in
+        // O(n). As with insert, only the first of several equal keys is kept.
+        // With a scheduler the leaves are filled as parallel tasks; they are
+        // taken from the allocator and linked up front, in key order, and
+        // the inner levels, a small fraction of the nodes, are packed after.
+        template <typename Iter>
+        void buildFromSorted(Iter begin, Iter end, WorkStealingScheduler* scheduler = nullptr) {
+            this->clear();
+
+            std::vector<Iter> items;
+            for (Iter it = begin; it != end; ++it) {
+                if (!items.empty() && !(items.back()->first < it->first)) continue;
+                items.push_back(it);
+            }
+            if (items.empty()) return;
+
+            // Leaves, spread evenly so none of them underflows
+            int n = (int)items.size();
+            int groups = (n + LEAF_CAPACITY - 1) / LEAF_CAPACITY;
+            std::vector<Node*> level(groups);
+            std::vector<int> firsts(groups + 1, 0);
+            std::vector<int> sizes(groups);
+            for (int g = 0; g < groups; ++g) {
+                sizes[g] = n / groups + (g < n % groups ? 1 : 0);
+                firsts[g + 1] = firsts[g] + sizes[g];
+
+                Leaf* leaf = createLeaf();
+                leaf->count = sizes[g];
+                leaf->prev = tail;
+                if (tail) tail->next = leaf;
+                else head = leaf;
+                tail = leaf;
+                level[g] = leaf;
+            }
+            fillLeaves(items, firsts, level, 0, groups, n >= PARALLEL_BUILD_GRAIN ? scheduler : nullptr);
+
+            std::vector<K> lowKeys(groups);
+            for (int g = 0; g < groups; ++g) lowKeys[g] = static_cast<Leaf*>(level[g])->keys[0];
+
+            // Inner levels until a single node is left
+            while (level.size() > 1) {
+                std::vector<Node*> parents;
+                std::vector<K> parentKeys;
+                std::vector<int> parentSizes;
+                int m = (int)level.size();
+                int parentCount = (m + INNER_CAPACITY) / (INNER_CAPACITY + 1);
+                for (int g = 0, first = 0; g < parentCount; ++g) {
+                    int take = m / parentCount + (g < m % parentCount ? 1 : 0);
+                    Inner* inner = createInner();
+                    int total = 0;
+                    for (int i = 0; i < take; ++i) {
+                        inner->children[i] = level[first + i];
+                        inner->sizes[i] = sizes[first + i];
+                        if (i > 0) inner->keys[i - 1] = lowKeys[first + i];
+                        total += sizes[first + i];
+                    }
+                    inner->count = take - 1;
+
+                    parents.push_back(inner);
+                    parentKeys.push_back(lowKeys[first]);
+                    parentSizes.push_back(total);
+                    first += take;
+                }
+                level.swap(parents);
+                lowKeys.swap(parentKeys);
+                sizes.swap(parentSizes);
+            }
+
+            this->root = level[0];
+            this->entryCount = n;
+        }
+
+        // Copies the entries of leaves [lo, hi) in from items; leaf g takes
+        // items[firsts[g]] up to items[firsts[g + 1]]
+        template <typename Iter>
+        void fillLeaves(const std::vector<Iter>& items, const std::vector<int>& firsts, const std::vector<Node*>& leaves,
+                        int lo, int hi, WorkStealingScheduler* scheduler) {
+            if (scheduler && firsts[hi] - firsts[lo] >= PARALLEL_BUILD_GRAIN) {
+                int mid = lo + (hi - lo) / 2;
+                WorkStealingScheduler::TaskGroup group;
+                scheduler->spawn(group, [&] { fillLeaves(items, firsts, leaves, lo, mid, scheduler); });
+                fillLeaves(items, firsts, leaves, mid, hi, scheduler);
+                scheduler->wait(group);
+                return;
+            }
+
+            for (int g = lo; g < hi; ++g) {
+                Leaf* leaf = static_cast<Leaf*>(leaves[g]);
+                for (int i = firsts[g]; i < firsts[g + 1]; ++i) {
+                    leaf->keys[i - firsts[g]] = items[i]->first;
+                    leaf->values[i - firsts[g]] = items[i]->second;
+                }
+            }
+        }
+};
+
+// ------------------------------
+// Eytzinger index (template)
+// ------------------------------
+// Read-only sorted (key, value) array. Keys are also laid out in BFS order
+// (the Eytzinger layout: children of i at 2i and 2i + 1), so a search walks
+// a perfectly balanced implicit tree whose top levels share cache lines, and
+// each step is a comparison feeding an index instead of a branch.
+template <class K, class T>
+class EytzingerIndex {
+    private:
+        std::vector<K> layout;      // keys in BFS order, 1-based
+        std::vector<int> rankAt;    // sorted position of layout[i]
+        std::vector<K> keys;        // sorted
+        std::vector<T> values;      // in the order of keys
+
+        void place(int node, int& next);
+        // Undoes the right turns taken below the answer of a descent
+        static int resolve(unsigned node);
+
+    public:
+        EytzingerIndex() {}
+
+        // (key, value) pairs in [begin, end) must be sorted by key
+        template <typename Iter>
+        void build(Iter begin, Iter end) {
+            this->clear();
+            for (Iter it = begin; it != end; ++it) {
+                keys.push_back(it->first);
+                values.push_back(it->second);
+            }
+
+            int n = (int)keys.size();
+            layout.resize(n + 1);
+            rankAt.resize(n + 1);
+            int next = 0;
+            place(1, next);
+        }
+
+        void clear();
+
+        int size() const { return (int)keys.size(); }
+        bool empty() const { return keys.empty(); }
+
+        // Sorted positions; size() if there is no such key
+        int lowerBound(const K& key) const; // first key >= key
+        int upperBound(const K& key) const; // first key > key
+
+        const K& keyAt(int pos) const { return keys[pos]; }
+        const T& valueAt(int pos) const { return values[pos]; }
+};
+
+// ------------------------------
+// Distance metrics
+// ------------------------------
+enum DistanceMetric { COSINE, EUCLIDEAN, MANHATTAN };
+
+// Structure behind the VectorStore distance index
+enum IndexKind { AVL_INDEX, BPLUS_INDEX };
+
+// ------------------------------
+// Distance kernels
+// ------------------------------
+// One implementation of the distance primitives over raw float spans,
+// accumulating in double. distanceKernels() is the set picked for the
+// running CPU; supportedDistanceKernels() lists every set it can run,
+// the scalar reference first.
+struct DistanceKernels {
+    const char* name;
+    void (*cosineParts)(const float* a, const float* b, size_t n, double& dot, double& normA, double& normB);
+    double (*dot)(const float* a, const float* b, size_t n);
+    double (*l1)(const float* a, const float* b, size_t n);
+    double (*squaredL2)(const float* a, const float* b, size_t n);
+};
+
+const DistanceKernels& distanceKernels();
+std::vector<DistanceKernels> supportedDistanceKernels();
+
+// ------------------------------
+// IndexKey
+// ------------------------------
+// Key of the VectorStore indexes: a distance or norm made unique by the
+// record id, so records with equal values no longer collide.
+struct IndexKey {
+    double value;
+    int id;
+
+    IndexKey() : value(0.0), id(0) {}
+    IndexKey(double value, int id) : value(value), id(id) {}
+
+    // Bounds sorting before / after every key with this value
+    static IndexKey lowest(double value) { return IndexKey(value, std::numeric_limits<int>::min()); }
+    static IndexKey highest(double value) { return IndexKey(value, std::numeric_limits<int>::max()); }
+
+    bool operator<(const IndexKey& other) const {
+        return value < other.value || (value == other.value && id < other.id);
+    }
+    bool operator>(const IndexKey& other) const { return other < *this; }
+    bool operator<=(const IndexKey& other) const { return !(other < *this); }
+    bool operator>=(const IndexKey& other) const { return !(*this < other); }
+    bool operator==(const IndexKey& other) const { return value == other.value && id == other.id; }
+    bool operator!=(const IndexKey& other) const { return !(*this == other); }
+};
+
+// ------------------------------
+// VectorArena
+// ------------------------------
+// Every embedding of a store in one row-major float matrix. Rows are padded
+// to a multiple of 64 bytes and the matrix itself is 64-byte aligned, so a
+// scan over the slots walks memory linearly. Removed slots are recycled
+// through a free list; compact() closes the gaps they leave behind.
+// The row block can be shared with read-only views (see shareFrom); the
+// arena then never writes a row a view may read, and moves to a block of
+// its own before rewriting rows in place.
+class VectorArena {
+    private:
+        static const size_t ALIGNMENT = 64;
+
+        int dimension;
+        int stride;                     // floats per row
+        int capacity;                   // rows allocated
+        int used;                       // rows handed out so far
+        int liveCount;
+        std::shared_ptr<void> block;    // raw allocation, rows is aligned inside it
+        float* rows;
+        std::vector<int> owners;        // id stored in each slot, -1 if free
+        std::vector<double> norms;      // L2 norm of each row, set on write
+        std::vector<int> freeSlots;
+
+        bool holdReleased;
+        std::vector<int> heldSlots;     // released while holdReleased is on
+        int generation;                 // bumped whenever slot numbers change meaning
+
+        void grow(int minCapacity);
+        // Moves the rows to a new block of capacity rows
+        void reallocate(int newCapacity);
+
+    public:
+        explicit VectorArena(int dimension);
+
+        VectorArena(const VectorArena&) = delete;
+        VectorArena& operator=(const VectorArena&) = delete;
+
+        // Copies dimension floats from values (zero-padding past count) into a
+        // free slot tagged with owner and returns the slot
+        int allocate(int owner, const float* values, size_t count);
+        void release(int slot);
+        void clear();
+        // Makes this arena a read-only view of other: same slots, sharing
+        // its rows, which stay allocated for as long as the view holds them
+        void shareFrom(const VectorArena& other);
+        // Gives this arena a block of its own if a view shares the current
+        // one; call it before writing rows in place
+        void unshare();
+        // Recomputes the stored norm after the row was written in place
+        double refreshNorm(int slot);
+
+        // While holding, released slots are kept off the free list: a view
+        // may still read them. takeHeld() hands them over, and once no view
+        // can read them any more recycle() makes them free. Slots taken
+        // before a later compact() or clear() are dropped by recycle().
+        void setHoldReleased(bool hold);
+        std::vector<int> takeHeld();
+        void recycle(const std::vector<int>& slots, int takenGeneration);
+        int getGeneration() const { return generation; }
+
+        // Moves the live rows down over the free slots, keeping their order.
+        // Returns old slot -> new slot, -1 for slots that were free.
+        std::vector<int> compact();
+
+        float* row(int slot) { return rows + (size_t)slot * stride; }
+        const float* row(int slot) const { return rows + (size_t)slot * stride; }
+
+        double norm(int slot) const { return norms[slot]; }
+        bool isLive(int slot) const { return owners[slot] >= 0; }
+        int ownerOf(int slot) const { return owners[slot]; }
+        int getDimension() const { return dimension; }
+        int slotCount() const { return used; }
+        int size() const { return liveCount; }
+        int freeCount() const { return used - liveCount; }
+};
+
+// ------------------------------
+// IdIndex
+// ------------------------------
+// Open-addressing hash map from record id to slot. Linear probing over a
+// power-of-two table kept at most half full; erase shifts the rest of the
+// probe run back instead of leaving tombstones.
+class IdIndex {
+    private:
+        static const int EMPTY = -1;
+
+        struct Entry {
+            int id;
+            int slot;
+        };
+
+        std::vector<Entry> table;
+        size_t mask;
+        int entryCount;
+
+        size_t home(int id) const;
+        void rehash(size_t capacity);
+
+    public:
+        IdIndex();
+
+        // Adds id or moves it to a new slot; ids must be non-negative
+        void insert(int id, int slot);
+        bool erase(int id);
+        // Slot of id, -1 if absent
+        int find(int id) const;
+        bool contains(int id) const { return find(id) >= 0; }
+
+        int size() const { return entryCount; }
+        void clear();
+};
+
+// ------------------------------
+// ThreadPool
+// ------------------------------
+// Fixed set of worker threads running one fork-join job at a time. The
+// calling thread takes tasks too, so a pool of size n starts n - 1
+// threads. A caller that finds the pool busy runs its job inline.
+class ThreadPool {
+    private:
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::mutex submitMutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+
+        const std::function<void(int)>* job;
+        int taskCount;
+        int nextTask;
+        int pending;                    // tasks started but not finished
+        unsigned generation;            // bumped for every job
+        bool stopping;
+
+        void workerLoop();
+        void runTasks(std::unique_lock<std::mutex>& lock);
+
+    public:
+        explicit ThreadPool(int threads);
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        int size() const { return (int)workers.size() + 1; }
+        // Runs body(0) .. body(tasks - 1) and returns once all have finished
+        void parallelFor(int tasks, const std::function<void(int)>& body);
+};
+
+// ------------------------------
+// EpochReclaimer
+// ------------------------------
+// Epoch-based reclamation for one writer and any number of readers. A
+// reader announces the global epoch it entered in; the writer retires
+// objects instead of freeing them, and an object retired in epoch e is
+// freed once every reader still inside entered after e.
+class EpochReclaimer {
+    private:
+        static const int MAX_READERS = 128;
+
+        struct alignas(64) ReaderSlot {
+            std::atomic<uint64_t> epoch;    // 0 while the slot is free
+        };
+
+        struct Retired {
+            uint64_t epoch;
+            std::function<void()> release;
+        };
+
+        std::atomic<uint64_t> globalEpoch;
+        ReaderSlot readers[MAX_READERS];
+        std::vector<Retired> retired;       // writer side only, oldest first
+
+        uint64_t oldestReader() const;
+
+    public:
+        EpochReclaimer();
+        ~EpochReclaimer();
+
+        EpochReclaimer(const EpochReclaimer&) = delete;
+        EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+        // Reader side; enter() returns the slot to hand back to leave()
+        int enter();
+        void leave(int slot);
+
+        // Writer side. release runs on the writer, from a later collect()
+        void retire(std::function<void()> release);
+        // Starts a new epoch and frees what no reader can still hold
+        void collect();
+        // Waits for the readers inside now to leave, then frees everything
+        void synchronize();
+        int pendingCount() const { return (int)retired.size(); }
+};
+
 // ------------------------------
 // VectorRecord
 // ------------------------------
@@ -175,11 +1201,16 @@ class VectorRecord {
         int id;                             
         std::string rawText;                
         int rawLength;                      
+        // Records held by a VectorStore keep their embedding in its arena at
+        // slot and leave vector null, so read it through
+        // VectorStore::getVectorData(); detached records (e.g. a centroid)
+        // own vector instead and have slot -1
         std::vector<float>* vector;         
+        int slot;
         double distanceFromReference;       
 
         VectorRecord()
-            : id(-1), rawLength(0), vector(nullptr), distanceFromReference(0.0) {}
+            : id(-1), rawLength(0), vector(nullptr), slot(-1), distanceFromReference(0.0) {}
 
         VectorRecord(int _id,
                     const std::string& _rawText,
@@ -189,22 +1220,70 @@ class VectorRecord {
             rawText(_rawText),
             rawLength(static_cast<int>(_rawText.size())),
             vector(_vec),
+            slot(-1),
             distanceFromReference(_dist) {}
 
         // Overload operator << to print only the id
         friend std::ostream& operator<<(std::ostream& os, const VectorRecord& record);
 };
 
+// ------------------------------
+// RecordTable
+// ------------------------------
+// A VectorStore's records by arena slot; free slots hold none. Each record
+// is a refcounted object of its own, so a snapshot copies pointers rather
+// than records and text. The store changes a record through edit(), which
+// first copies it if a snapshot still holds it.
+class RecordTable {
+    private:
+        std::vector<std::shared_ptr<VectorRecord>> slots;
+
+    public:
+        int size() const { return (int)slots.size(); }
+        void resize(int n) { slots.resize(n); }
+        void clear() { slots.clear(); }
+
+        bool holds(int slot) const { return slots[slot] != nullptr; }
+        VectorRecord& operator[](int slot) const { return *slots[slot]; }
+        VectorRecord& edit(int slot);
+
+        void assign(int slot, VectorRecord&& record) { slots[slot] = std::make_shared<VectorRecord>(std::move(record)); }
+        void release(int slot) { slots[slot].reset(); }
+        void move(int from, int to) { slots[to] = std::move(slots[from]); }
+};
+
 // ------------------------------
 // VectorStore
 // ------------------------------
+// Records live once, in a table indexed by their arena slot; the indexes
+// map (distance, id) and (norm, id) to that slot. Record pointers handed out
+// stay valid until the record is removed or compactVectors() runs; with
+// concurrent reads on, a setReferenceVector() or forEach() also replaces
+// those a snapshot still shares.
 class VectorStore {
+    friend class ShardedVectorStore;
+
     private:
-        AVLTree<double, VectorRecord>* vectorStore;
-        RedBlackTree<double, VectorRecord>* normIndex;
+        // Distance index: vectorStore with AVL_INDEX, distanceTree with
+        // BPLUS_INDEX; the other one is null
+        AVLTree<IndexKey, int>* vectorStore;
+        BPlusTree<IndexKey, int>* distanceTree;
+        RedBlackTree<IndexKey, int>* normIndex;
 
         std::vector<float>* referenceVector;
-        VectorRecord* rootVector;
+        int rootSlot;
+        VectorArena* vectors;
+        RecordTable records;
+        IdIndex idIndex;
+
+        // Sorted-array copies of both indexes, in use while frozen
+        EytzingerIndex<IndexKey, int>* frozenDistance;
+        EytzingerIndex<IndexKey, int>* frozenNorm;
+        bool frozen;
+
+        // Null while scans and rebuilds run on the calling thread only
+        ThreadPool* pool;
+        WorkStealingScheduler* scheduler;
 
         int dimension;
         int count;
@@ -213,22 +1292,174 @@ class VectorStore {
 
         std::vector<float>* (*embeddingFunction)(const std::string&);
 
+        // Concurrent-read mode; epochs is null while it is off
+        EpochReclaimer* epochs;
+        std::atomic<VectorStore*> published;
+        mutable std::mutex writeMutex;
+        mutable std::atomic<std::thread::id> lockHolder;    // thread holding writeMutex, if any
+        std::atomic<std::thread::id> writer;    // thread that made the last change
+        bool writing;                           // a WriteGuard is open, under writeMutex
+        int publishInterval;
+        int unpublishedWrites;
+
+        // Taken by every call that changes the store. In concurrent mode it
+        // holds writeMutex and publishes a snapshot on the way out when
+        // enough changes have piled up; nested guards on the writing
+        // thread do nothing.
+        class WriteGuard {
+            private:
+                VectorStore& store;
+                bool locked;
+                bool outermost;
+            public:
+                explicit WriteGuard(VectorStore& store);
+                ~WriteGuard();
+        };
+
+        // Read-only copy of the store for readers: same records, slots and
+        // ids, sharing the arena rows and the records themselves, with no
+        // pool and concurrent reads off
+        VectorStore* snapshot() const;
+        void publishSnapshot();
+        // Frees old once no reader holds it. Slots released since old was
+        // taken are still live in it, so they are reused only after that.
+        void retireSnapshot(VectorStore* old);
+
         double distanceByMetric(const std::vector<float>& a,
                                 const std::vector<float>& b,
-                                const std::string& metric) const;
+                                DistanceMetric metric) const;
+
+        // Query kernels specialised per metric; the public overloads taking a
+        // metric name resolve it once through parseMetric
+        // (score, id) of the best record, id -1 when the store is empty
+        template <DistanceMetric M>
+        std::pair<double, int> findNearestImpl(const std::vector<float>& query) const;
+        template <DistanceMetric M>
+        std::vector<std::pair<double, int>> topKImpl(const std::vector<float>& query, const std::vector<int>& candidateSlots, int k) const;
+        template <DistanceMetric M>
+        std::vector<int> rangeQueryImpl(const std::vector<float>& query, double radius) const;
+        // Scores nq queries against every live row in cache-sized tiles and
+        // calls visit(query, slot, score); each query sees slots in order
+        template <DistanceMetric M, typename Visit>
+        void scanBatch(const float* queries, int nq, Visit visit) const;
+
+        // Splits [0, items) into chunks of at least minChunk and calls
+        // body(chunk, begin, end) for each, on the pool when there is one.
+        // The split depends only on items and the worker count, so
+        // merging per-chunk results in chunk order is deterministic.
+        int chunkCount(int items, int minChunk) const;
+        template <typename Body>
+        void forEachChunk(int items, int chunks, Body body) const;
 
         void rebuildRootIfNeeded();
         void rebuildTreeWithNewRoot(VectorRecord* newRoot);
 
         VectorRecord* findVectorNearestToDistance(double targetDistance) const; 
 
+        // evaluations, if given, receives the number of records scored
+        std::vector<std::pair<double, int>> exactNearestL2(const std::vector<float>& query, int k, int* evaluations = nullptr) const;
+
+        double normOf(int slot) const;
+        void removeSlot(int slot);
+        void rebuildIndexes();
+
+        // Building blocks of the public calls, shared with ShardedVectorStore
+        void insertText(const std::string& rawText, int id);
+        int rankOf(const IndexKey& key) const;
+        std::vector<std::pair<double, int>> topKScored(const std::vector<float>& query, int k, DistanceMetric metric, bool exact);
+        std::pair<double, int> nearestScored(const std::vector<float>& query, DistanceMetric metric, bool exact) const;
+        std::vector<int> rangeFromRootIds(double minDist, double maxDist) const;
+        std::vector<int> boundingBoxIds(const std::vector<float>& minBound, const std::vector<float>& maxBound) const;
+        // Slot of the index-th record in distance order
+        int slotAt(int index) const;
+        // Per query: its (score, id) best, id -1 when the store is empty;
+        // its k best, best first; its ids within radius, in distance order
+        std::vector<std::pair<double, int>> nearestBatchScored(const float* queries, int nq, DistanceMetric metric) const;
+        std::vector<std::vector<std::pair<double, int>>> topKBatchScored(const float* queries, int nq, int k, DistanceMetric metric) const;
+        std::vector<std::vector<int>> rangeBatchIds(const float* queries, int nq, double radius, DistanceMetric metric) const;
+
+        // Scans visit slots, which removals and reuse shuffle; results are
+        // put back in distance order, the order of the distance index
+        IndexKey keyOf(int slot) const { return IndexKey(records[slot].distanceFromReference, records[slot].id); }
+        std::vector<int> idsInDistanceOrder(std::vector<int> slots) const;
+
+        // Calls f with the distance index in use; both trees share the
+        // operations the store needs
+        template <typename Func>
+        void withDistanceIndex(Func f) const {
+            if (distanceTree) f(*distanceTree);
+            else f(*vectorStore);
+        }
+
     public:
         VectorStore(int dimension,
                     std::vector<float>* (*embeddingFunction)(const std::string&),
-                    const std::vector<float>& referenceVector)
-        : dimension(dimension), embeddingFunction(embeddingFunction), referenceVector(new std::vector<float>(referenceVector)), vectorStore(new AVLTree<double, VectorRecord>()), normIndex(new RedBlackTree<double, VectorRecord>()), count(0), averageDistance(0.0), rootVector(nullptr) {}
+                    const std::vector<float>& referenceVector,
+                    IndexKind indexKind = AVL_INDEX)
+        : dimension(dimension), embeddingFunction(embeddingFunction), referenceVector(new std::vector<float>(referenceVector)), vectorStore(indexKind == AVL_INDEX ? new AVLTree<IndexKey, int>() : nullptr), distanceTree(indexKind == BPLUS_INDEX ? new BPlusTree<IndexKey, int>() : nullptr), normIndex(new RedBlackTree<IndexKey, int>()), count(0), averageDistance(0.0), rootSlot(-1), vectors(new VectorArena(dimension)), frozenDistance(new EytzingerIndex<IndexKey, int>()), frozenNorm(new EytzingerIndex<IndexKey, int>()), frozen(false), pool(nullptr), scheduler(nullptr), epochs(nullptr), published(nullptr), writing(false), publishInterval(0), unpublishedWrites(0) {}
         ~VectorStore() {
+            disableConcurrentReads();
             this->clear();
+            delete vectorStore;
+            delete normIndex;
+            delete referenceVector;
+            delete vectors;
+            delete distanceTree;
+            delete frozenDistance;
+            delete frozenNorm;
+            delete pool;
+            delete scheduler;
+        };
+
+        VectorStore(const VectorStore&) = delete;
+        VectorStore& operator=(const VectorStore&) = delete;
+
+        // Single-writer / multi-reader mode. Calls that change the store
+        // are serialised and work on the live indexes, and the thread that
+        // made the last change reads them too, so it sees its own writes.
+        // Other threads run without locks against the last published
+        // snapshot, which the writer replaces after publishInterval
+        // changes (0 scales the interval with the size, 1 publishes every
+        // change). Readers therefore lag by up to that many changes,
+        // size() / 64 by default, until the writer calls publish().
+        // Replaced snapshots are freed once no reader can still be using
+        // them. Turn it off only after the readers have stopped.
+        //
+        // Calls returning pointers into the store (getVector, getById,
+        // getVectorData, getReferenceVector, getRootVector and
+        // getAllVectorsSortedByDistance) throw std::logic_error on any
+        // thread but the writer unless a ReadGuard is held around them and
+        // the use of their result. Calls returning values need no guard.
+        void enableConcurrentReads(int publishInterval = 0);
+        void disableConcurrentReads();
+        bool concurrentReads() const { return epochs != nullptr; }
+        // Makes the changes so far visible to readers right away
+        void publish();
+
+        // Pins the published snapshot on this thread for the guard's
+        // lifetime, so successive calls see the same state and records
+        // and rows from it stay valid. On the writing thread the guard
+        // holds writeMutex instead and calls read the live store.
+        class ReadGuard {
+            private:
+                const VectorStore& store;
+                VectorStore* view;
+                int slot;
+                bool locked;
+                bool enclosed;      // view was pinned by an outer guard
+                const ReadGuard* outer;
+                static thread_local const ReadGuard* innermost;
+            public:
+                explicit ReadGuard(const VectorStore& store);
+                ~ReadGuard();
+
+                ReadGuard(const ReadGuard&) = delete;
+                ReadGuard& operator=(const ReadGuard&) = delete;
+
+                // Snapshot to query, or null to use the store itself
+                VectorStore* snapshot() const { return view; }
+                // As snapshot(), for calls returning pointers into it
+                VectorStore* pinnedSnapshot() const;
         };
 
         int size();
@@ -244,6 +1475,33 @@ class VectorStore {
 
         bool removeAt(int index);
 
+        // Lookups by record id, O(1) expected; ids are handed out in
+        // increasing order and never reused until clear()
+        VectorRecord* getById(int id);
+        bool removeById(int id);
+        bool containsId(int id) const;
+
+        // Closes the gaps removals left in the vector arena. Records move
+        // to new slots, so it only runs when called; removals leave their
+        // slots on a free list for later inserts instead.
+        void compactVectors();
+
+        // Serves rangeQueryFromRoot, the topKNearest candidate window and
+        // getMin/MaxDistance from flat Eytzinger arrays instead of the
+        // trees. Any change to the store thaws it again.
+        void freeze();
+        void thaw();
+        bool isFrozen() const;
+
+        // Threads used by the scans and by the rebuild in setReferenceVector,
+        // the calling one included; 0 picks the hardware concurrency.
+        // Results do not depend on it.
+        void setWorkerCount(int workers);
+        int getWorkerCount() const;
+
+        // Embedding of a record returned by this store (dimension floats)
+        const float* getVectorData(const VectorRecord* record) const;
+
         void setReferenceVector(const std::vector<float>& newReference);
         std::vector<float>* getReferenceVector() const; 
         VectorRecord* getRootVector() const; 
@@ -254,26 +1512,273 @@ class VectorStore {
         std::vector<int> getAllIdsSortedByDistance() const;
         std::vector<VectorRecord*> getAllVectorsSortedByDistance() const;
 
-        double cosineSimilarity(const std::vector<float>& v1, const std::vector<float>& v2);
+        // Vectorized at runtime for the host CPU (see distanceKernels)
         double cosineSimilarity(const std::vector<float>& v1, const std::vector<float>& v2) const;
-        double l1Distance(const std::vector<float>& v1, const std::vector<float>& v2);
         double l1Distance(const std::vector<float>& v1, const std::vector<float>& v2) const;
-        double l2Distance(const std::vector<float>& v1, const std::vector<float>& v2);
         double l2Distance(const std::vector<float>& v1, const std::vector<float>& v2) const;
 
         double estimateD_Linear(const std::vector<float>& query, int k, double averageDistance, const std::vector<float>& reference, double c0_bias = 1e-9, double c1_slope = 0.05);
 
-        int findNearest(const std::vector<float>& query, std::string metric = "cosine");
-        int* topKNearest(const std::vector<float>& query, int k, std::string metric = "cosine");
+        // Metric names are case-insensitive: "cosine", "euclidean", "manhattan"
+        static DistanceMetric parseMetric(const std::string& metric);
+
+        // Scans every record on the pool. exact = true switches
+        // "Euclidean" to the triangle-inequality pruned search, which only
+        // pays off at low dimension (see ./main exact)
+        int findNearest(const std::vector<float>& query, std::string metric = "cosine", bool exact = false);
+        int findNearest(const std::vector<float>& query, DistanceMetric metric, bool exact = false);
+        // exact = true scores every record instead of the norm window; for
+        // "Euclidean" it uses the triangle-inequality pruned search
+        int* topKNearest(const std::vector<float>& query, int k, std::string metric = "cosine", bool exact = false);
+        int* topKNearest(const std::vector<float>& query, int k, DistanceMetric metric, bool exact = false);
+        // Records the exact Euclidean search scores for query, against
+        // size() for a plain scan; for measuring how much the bound prunes
+        int exactSearchEvaluations(const std::vector<float>& query, int k) const;
 
+        // All three return ids in distance order from the reference.
+        // topKNearest breaks score ties by id, findNearest by distance order.
         int* rangeQueryFromRoot(double minDist, double maxDist) const;
         int* rangeQuery(const std::vector<float>& query, double radius, std::string metric = "cosine") const;
+        int* rangeQuery(const std::vector<float>& query, double radius, DistanceMetric metric) const;
         int* boundingBoxQuery(const std::vector<float>& minBound, const std::vector<float>& maxBound) const;
 
+        // Batch queries: queries holds nq rows of dimension floats. Each tile
+        // of records is loaded once per tile of queries rather than once per
+        // query. All three score every record, like topKNearest with exact.
+        // findNearestBatch returns nq ids; topKNearestBatch returns nq * k
+        // ids, query i's best first at [i * k, (i + 1) * k); rangeQueryBatch
+        // returns query i's ids at [offsets[i], offsets[i + 1]).
+        int* findNearestBatch(const float* queries, int nq, DistanceMetric metric = COSINE) const;
+        int* topKNearestBatch(const float* queries, int nq, int k, DistanceMetric metric = COSINE) const;
+        int* rangeQueryBatch(const float* queries, int nq, double radius, DistanceMetric metric,
+                             std::vector<int>& offsets) const;
+
         double getMaxDistance() const;
         double getMinDistance() const;
         VectorRecord computeCentroid(const std::vector<VectorRecord*>& records) const;
 };
 
+// ------------------------------
+// ShardedVectorStore
+// ------------------------------
+// Spreads records over independent VectorStore shards by a hash of their
+// id. Ids come from one counter, so they stay unique across shards.
+// Queries fan out to the shards on a thread pool and the partial results
+// are merged: a k-way merge for topKNearest and findNearest, a union for
+// the range and bounding-box queries, per query for the batch forms.
+// Positional calls (getVector, removeAt, ...) follow the global distance
+// order, located by rank searches over the shards in O(S^2 log^2 n) for
+// S shards.
+class ShardedVectorStore {
+    private:
+        std::vector<VectorStore*> shards;
+        ThreadPool* pool;
+        int curId;
+        // Serialises the calls that change the store
+        std::mutex writeMutex;
+
+        int shardOf(int id) const;
+        // Shard holding the index-th record of stores in distance order,
+        // and its index inside that shard
+        std::pair<int, int> locate(const std::vector<VectorStore*>& stores, int index) const;
+        // Joins per-shard id lists, each in distance order, into one list
+        // in global distance order
+        std::vector<int> unionByDistance(const std::vector<VectorStore*>& stores,
+                                         const std::vector<std::vector<int>>& parts) const;
+        // Calls f(shard) for every shard, in parallel when there is a pool
+        template <typename Func>
+        void fanOut(Func f) const;
+        // fanOut for calls that change the shards. In concurrent mode they
+        // run on the calling thread, which so stays the shards' writer.
+        template <typename Func>
+        void fanOutWrite(Func f);
+
+    public:
+        ShardedVectorStore(int shardCount,
+                           int dimension,
+                           std::vector<float>* (*embeddingFunction)(const std::string&),
+                           const std::vector<float>& referenceVector,
+                           IndexKind indexKind = AVL_INDEX);
+        ~ShardedVectorStore();
+
+        ShardedVectorStore(const ShardedVectorStore&) = delete;
+        ShardedVectorStore& operator=(const ShardedVectorStore&) = delete;
+
+        int getShardCount() const { return (int)shards.size(); }
+        // Records held by one shard. The shards themselves stay private:
+        // adding to one directly would bypass the id assignment.
+        int getShardSize(int shard) const { return shards[shard]->size(); }
+        // Threads used for the fan-out, the calling one included; 0 picks
+        // the hardware concurrency. Readers share the pool, so with
+        // concurrent reads on it may only change while none is running.
+        void setWorkerCount(int workers);
+        int getWorkerCount() const;
+
+        // VectorStore's concurrent-read mode on every shard, with the same
+        // rules. Each shard publishes on its own schedule, so a reader can
+        // see a change to one shard before an earlier change to another.
+        void enableConcurrentReads(int publishInterval = 0);
+        void disableConcurrentReads();
+        bool concurrentReads() const { return shards[0]->concurrentReads(); }
+        void publish();
+
+        // Holds a VectorStore::ReadGuard on every shard, so successive calls
+        // see the same state and records from them stay valid
+        class ReadGuard {
+            private:
+                std::vector<std::unique_ptr<VectorStore::ReadGuard>> guards;
+                std::vector<VectorStore*> views;
+            public:
+                explicit ReadGuard(const ShardedVectorStore& store);
+                ~ReadGuard();
+
+                ReadGuard(const ReadGuard&) = delete;
+                ReadGuard& operator=(const ReadGuard&) = delete;
+
+                // Per shard, the snapshot to query or the shard itself
+                const std::vector<VectorStore*>& shards() const { return views; }
+                // As shards(), for calls returning pointers into them
+                const std::vector<VectorStore*>& pinnedShards() const;
+        };
+
+        int size();
+        bool empty();
+        void clear();
+
+        std::vector<float>* preprocessing(std::string rawText);
+        void addText(std::string rawText);
+
+        VectorRecord* getVector(int index);
+        std::string   getRawText(int index);
+        int           getId(int index);
+
+        bool removeAt(int index);
+
+        VectorRecord* getById(int id);
+        bool removeById(int id);
+        bool containsId(int id) const;
+
+        void compactVectors();
+        void freeze();
+        void thaw();
+        // True once every shard is frozen
+        bool isFrozen() const;
+
+        const float* getVectorData(const VectorRecord* record) const;
+
+        void setReferenceVector(const std::vector<float>& newReference);
+        std::vector<float>* getReferenceVector() const;
+        // Of the shard roots, the one nearest the overall average distance
+        VectorRecord* getRootVector() const;
+        double getAverageDistance() const;
+        void setEmbeddingFunction(std::vector<float>* (*newEmbeddingFunction)(const std::string&));
+
+        // Visits the shards one after another, each in its distance order
+        void forEach(void (*action)(std::vector<float>&, int, std::string&));
+        std::vector<int> getAllIdsSortedByDistance() const;
+        std::vector<VectorRecord*> getAllVectorsSortedByDistance() const;
+
+        // Same kernels as VectorStore; they do not depend on the records
+        double cosineSimilarity(const std::vector<float>& v1, const std::vector<float>& v2) const;
+        double l1Distance(const std::vector<float>& v1, const std::vector<float>& v2) const;
+        double l2Distance(const std::vector<float>& v1, const std::vector<float>& v2) const;
+
+        double estimateD_Linear(const std::vector<float>& query, int k, double averageDistance, const std::vector<float>& reference, double c0_bias = 1e-9, double c1_slope = 0.05);
+
+        static DistanceMetric parseMetric(const std::string& metric) { return VectorStore::parseMetric(metric); }
+
+        int findNearest(const std::vector<float>& query, std::string metric = "cosine", bool exact = false);
+        int findNearest(const std::vector<float>& query, DistanceMetric metric, bool exact = false);
+        int* topKNearest(const std::vector<float>& query, int k, std::string metric = "cosine", bool exact = false);
+        int* topKNearest(const std::vector<float>& query, int k, DistanceMetric metric, bool exact = false);
+        // Summed over the shards, each asked for its own top k
+        int exactSearchEvaluations(const std::vector<float>& query, int k) const;
+
+        // The unions below come back in global distance order
+        int* rangeQueryFromRoot(double minDist, double maxDist) const;
+        int* rangeQuery(const std::vector<float>& query, double radius, std::string metric = "cosine") const;
+        int* rangeQuery(const std::vector<float>& query, double radius, DistanceMetric metric) const;
+        int* boundingBoxQuery(const std::vector<float>& minBound, const std::vector<float>& maxBound) const;
+
+        // Laid out as VectorStore's batch queries. Every shard scores the
+        // whole batch; the per-query results are merged like the single
+        // queries above.
+        int* findNearestBatch(const float* queries, int nq, DistanceMetric metric = COSINE) const;
+        int* topKNearestBatch(const float* queries, int nq, int k, DistanceMetric metric = COSINE) const;
+        int* rangeQueryBatch(const float* queries, int nq, double radius, DistanceMetric metric,
+                             std::vector<int>& offsets) const;
+
+        double getMaxDistance() const;
+        double getMinDistance() const;
+        VectorRecord computeCentroid(const std::vector<VectorRecord*>& records) const;
+};
+
+// ------------------------------
+// FixedVectorStore<Dim>
+// ------------------------------
+// Variant of VectorStore for a dimension known at compile time. Embeddings
+// live in 64-byte aligned fixed-size arrays and are scored with kernels
+// instantiated for Dim, so loop bounds are constants. Instantiated in
+// VectorStore.cpp for Dim = 384, 768, 1024 and 1536.
+template <int Dim>
+class FixedVectorStore {
+    public:
+        struct alignas(64) Embedding {
+            std::array<float, Dim> values;
+        };
+
+        class Record {
+            public:
+                int id;
+                std::string rawText;
+                Embedding* vector;
+                double distanceFromReference;
+                double norm;
+
+                Record() : id(-1), vector(nullptr), distanceFromReference(0.0), norm(0.0) {}
+                Record(int id, const std::string& rawText, Embedding* vector, double distance, double norm)
+                    : id(id), rawText(rawText), vector(vector), distanceFromReference(distance), norm(norm) {}
+        };
+
+    private:
+        // Keyed like the VectorStore indexes, so equal distances or norms
+        // of different records do not collide
+        AVLTree<IndexKey, Record>* vectorStore;
+        RedBlackTree<IndexKey, Record>* normIndex;
+
+        Embedding referenceVector;
+        int count;
+        int curId;
+        double averageDistance;
+
+        std::vector<float>* (*embeddingFunction)(const std::string&);
+
+        static void toEmbedding(const std::vector<float>& src, Embedding& dst);
+        static double normOf(const Embedding& v);
+
+        template <DistanceMetric M>
+        std::vector<std::pair<double, int>> topKImpl(const Embedding& query, const std::vector<Record*>& candidates, int k) const;
+        template <DistanceMetric M>
+        std::vector<int> rangeQueryImpl(const Embedding& query, double radius) const;
+
+    public:
+        FixedVectorStore(std::vector<float>* (*embeddingFunction)(const std::string&),
+                         const std::vector<float>& referenceVector);
+        ~FixedVectorStore();
+
+        int size() const { return count; }
+        bool empty() const { return count == 0; }
+        void clear();
+
+        void addText(const std::string& rawText);
+        Record* getVector(int index);
+        bool removeAt(int index);
+
+        double getAverageDistance() const { return averageDistance; }
+
+        int* topKNearest(const std::vector<float>& query, int k, DistanceMetric metric = COSINE);
+        int* rangeQuery(const std::vector<float>& query, double radius, DistanceMetric metric = COSINE) const;
+};
+
 
 #endif // VECTORSTORE_H
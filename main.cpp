@@ -1,6 +1,427 @@
 #include "VectorStore.h"
+#include <chrono>
 
-int main() {
-    // Student can use this main function to do some basic testing
+// Checks and benchmarks for the store. Run with the name of one of the
+// commands below; with no name the usage is printed.
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static float unitNoise(unsigned& seed) {
+    seed = seed * 1103515245u + 12345u;
+    return (seed >> 8) / 16777216.0f;
+}
+
+// Fixed-seed keys, so every run and every tree sees the same sequence
+static vector<IndexKey> randomKeys(int n, unsigned seed) {
+    vector<IndexKey> keys;
+    keys.reserve(n);
+    for (int i = 0; i < n; ++i) keys.push_back(IndexKey(unitNoise(seed), i));
+    return keys;
+}
+
+// =====================================
+// kernels: every SIMD kernel set against the scalar one
+// =====================================
+// The sets differ only in summation order, so each result must agree with
+// the scalar one to within a few ulps of the sum of absolute terms. Every
+// length 0..1536 is checked, which covers each tail size of each vector
+// width, at every float offset within a 64-byte line so both aligned and
+// unaligned loads are exercised.
+static bool closeEnough(double expected, double actual, double magnitude) {
+    return fabs(expected - actual) <= 1e-12 * magnitude + 1e-300;
+}
+
+static int checkKernels() {
+    const int MAX_LENGTH = 1536, OFFSETS = 16;
+    vector<DistanceKernels> sets = supportedDistanceKernels();
+    const DistanceKernels& scalar = sets[0];
+
+    // Mixed signs and magnitudes
+    unsigned seed = 12345;
+    vector<float> a(MAX_LENGTH + OFFSETS), b(MAX_LENGTH + OFFSETS);
+    for (size_t i = 0; i < a.size(); ++i) {
+        a[i] = (unitNoise(seed) - 0.5f) * (i % 7 == 0 ? 1000.0f : 1.0f);
+        b[i] = (unitNoise(seed) - 0.5f) * (i % 5 == 0 ? 0.001f : 1.0f);
+    }
+
+    int failures = 0;
+    for (size_t s = 1; s < sets.size(); ++s) {
+        const DistanceKernels& simd = sets[s];
+        int checked = 0;
+        for (int n = 0; n <= MAX_LENGTH; ++n) {
+            for (int offset = 0; offset < OFFSETS; ++offset) {
+                const float* x = a.data() + offset;
+                const float* y = b.data() + (OFFSETS - 1 - offset);
+
+                double dotMag = 0.0, aMag = 0.0, bMag = 0.0, l1Mag = 0.0, l2Mag = 0.0;
+                for (int i = 0; i < n; ++i) {
+                    double diff = (double)x[i] - y[i];
+                    dotMag += fabs((double)x[i] * y[i]);
+                    aMag += (double)x[i] * x[i];
+                    bMag += (double)y[i] * y[i];
+                    l1Mag += fabs(diff);
+                    l2Mag += diff * diff;
+                }
+
+                double dot0, normA0, normB0, dot1, normA1, normB1;
+                scalar.cosineParts(x, y, n, dot0, normA0, normB0);
+                simd.cosineParts(x, y, n, dot1, normA1, normB1);
+
+                bool ok = closeEnough(dot0, dot1, dotMag)
+                       && closeEnough(normA0, normA1, aMag)
+                       && closeEnough(normB0, normB1, bMag)
+                       && closeEnough(scalar.dot(x, y, n), simd.dot(x, y, n), dotMag)
+                       && closeEnough(scalar.l1(x, y, n), simd.l1(x, y, n), l1Mag)
+                       && closeEnough(scalar.squaredL2(x, y, n), simd.squaredL2(x, y, n), l2Mag);
+                if (!ok) {
+                    if (failures < 10) cout << simd.name << " differs at length " << n << ", offset " << offset << endl;
+                    ++failures;
+                }
+                ++checked;
+            }
+        }
+        cout << simd.name << ": " << checked << " cases against scalar" << endl;
+    }
+
+    cout << "in use: " << distanceKernels().name << endl;
+    cout << (failures ? "kernels FAILED" : "kernels ok") << endl;
+    return failures ? 1 : 0;
+}
+
+// =====================================
+// alloc: slab allocator vs new / delete
+// =====================================
+// Inserts every key, removes and re-inserts half of them, then clears:
+// the node churn of an ingest with deletions
+template <class Tree>
+static double churn(Tree& tree, const vector<IndexKey>& keys) {
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < keys.size(); ++i) tree.insert(keys[i], (int)i);
+    for (size_t i = 0; i < keys.size(); i += 2) tree.remove(keys[i]);
+    for (size_t i = 0; i < keys.size(); i += 2) tree.insert(keys[i], (int)i);
+    tree.clear();
+    return secondsSince(start);
+}
+
+template <template <class, class> class Tree>
+static void compareAllocators(const char* name, const vector<IndexKey>& keys, int rounds) {
+    double slab = 0.0, heap = 0.0;
+    for (int r = 0; r < rounds; ++r) {
+        Tree<IndexKey, int> slabTree;
+        slab += churn(slabTree, keys);
+
+        HeapNodeAllocator allocator;
+        Tree<IndexKey, int> heapTree(&allocator);
+        heap += churn(heapTree, keys);
+    }
+    cout << name << ": slab " << slab / rounds << "s, new/delete " << heap / rounds
+         << "s, speedup " << heap / slab << "x" << endl;
+}
+
+static int benchAllocator() {
+    for (int n : {10000, 100000, 1000000}) {
+        vector<IndexKey> keys = randomKeys(n, 42);
+        int rounds = n < 1000000 ? 3 : 1;
+        cout << "n = " << n << endl;
+        compareAllocators<AVLTree>("  AVLTree", keys, rounds);
+        compareAllocators<RedBlackTree>("  RedBlackTree", keys, rounds);
+        compareAllocators<BPlusTree>("  BPlusTree", keys, rounds);
+    }
+    return 0;
+}
+
+// =====================================
+// nodes: tree descents at 1M keys
+// =====================================
+// Times insert, contains and lowerBound with VectorRecord payloads, which
+// sit out of line behind the hot node, and with double payloads, which
+// sit inline. Build with -DTREE_INLINE_PAYLOADS for the old layout, or
+// with -DTREE_NO_PREFETCH to drop the child prefetch, and compare.
+template <class Tree, class T>
+static void timeDescents(const char* name, const vector<double>& keys, const vector<double>& probes, const T& payload) {
+    Tree tree;
+    auto start = chrono::steady_clock::now();
+    for (double key : keys) tree.insert(key, payload);
+    double insert = secondsSince(start);
+
+    // Half the probes are keys, half fall between them
+    int found = 0;
+    start = chrono::steady_clock::now();
+    for (double probe : probes) found += tree.contains(probe);
+    double contains = secondsSince(start);
+
+    int ended = 0;
+    start = chrono::steady_clock::now();
+    for (double probe : probes) ended += (tree.lowerBound(probe) == tree.end());
+    double lowerBound = secondsSince(start);
+
+    double perKey = 1e9 / keys.size(), perProbe = 1e9 / probes.size();
+    cout << "  " << name << ": insert " << insert * perKey << "ns, contains " << contains * perProbe
+         << "ns, lowerBound " << lowerBound * perProbe << "ns (" << found << " found, " << ended << " past the end)" << endl;
+}
+
+static int benchNodes() {
+    const int n = 1000000;
+    unsigned seed = 99;
+    vector<double> keys(n), probes(n);
+    for (int i = 0; i < n; ++i) keys[i] = unitNoise(seed) * 1e6 + i * 1e-7;
+    for (int i = 0; i < n; ++i) probes[i] = (i % 2) ? keys[(i * 7919) % n] : unitNoise(seed) * 1e6 + 0.5e-7;
+
+#if defined(TREE_INLINE_PAYLOADS)
+    const char* layout = "payloads inline (old layout)";
+#else
+    const char* layout = "large payloads out of line";
+#endif
+#if defined(__GNUC__) && !defined(TREE_NO_PREFETCH)
+    const char* prefetch = "prefetch on";
+#else
+    const char* prefetch = "prefetch off";
+#endif
+    cout << "n = " << n << ", " << layout << ", " << prefetch << endl;
+
+    VectorRecord record(1, "a record text longer than the small string buffer", nullptr, 0.0);
+    timeDescents<AVLTree<double, VectorRecord>>("AVLTree<double, VectorRecord>", keys, probes, record);
+    timeDescents<RedBlackTree<double, VectorRecord>>("RedBlackTree<double, VectorRecord>", keys, probes, record);
+    timeDescents<AVLTree<double, double>>("AVLTree<double, double>", keys, probes, 0.0);
+    timeDescents<RedBlackTree<double, double>>("RedBlackTree<double, double>", keys, probes, 0.0);
+    return 0;
+}
+
+// =====================================
+// Synthetic embeddings
+// =====================================
+// Texts are record numbers; each maps to a fixed pseudo-random vector of
+// benchDimension floats around one of benchClusters centres
+static int benchDimension = 64;
+static int benchClusters = 1;
+
+static vector<float>* benchEmbedding(const string& text) {
+    unsigned index = (unsigned)stoul(text);
+    unsigned centreSeed = 7919u * (index % benchClusters) + 1;
+    unsigned seed = 2654435761u * index + 17;
+
+    vector<float>* v = new vector<float>(benchDimension);
+    for (int i = 0; i < benchDimension; ++i) {
+        float centre = benchClusters > 1 ? 4.0f * unitNoise(centreSeed) : 0.0f;
+        (*v)[i] = centre + unitNoise(seed);
+    }
+    return v;
+}
+
+static VectorStore* benchStore(int n, int dimension, int clusters, IndexKind indexKind = AVL_INDEX) {
+    benchDimension = dimension;
+    benchClusters = clusters;
+    VectorStore* store = new VectorStore(dimension, benchEmbedding, vector<float>(dimension, 0.0f), indexKind);
+    for (int i = 0; i < n; ++i) store->addText(to_string(i));
+    return store;
+}
+
+// Queries drawn from the same distribution as the records, past their ids
+static vector<float> benchQueries(int nq, int n) {
+    vector<float> queries;
+    for (int q = 0; q < nq; ++q) {
+        vector<float>* v = benchEmbedding(to_string(n + q));
+        queries.insert(queries.end(), v->begin(), v->end());
+        delete v;
+    }
+    return queries;
+}
+
+// =====================================
+// exact: pruned Euclidean kNN vs brute force
+// =====================================
+// Counts the distance evaluations of topKNearest(..., EUCLIDEAN, true)
+// against the n of a full scan, checks both return the same ids and
+// times them
+static int benchExactSearch() {
+    const int n = 20000, nq = 200, k = 10;
+    struct Setting { int dimension; int clusters; };
+    for (Setting setting : { Setting{8, 1}, Setting{8, 16}, Setting{64, 1}, Setting{64, 16}, Setting{384, 16} }) {
+        VectorStore* store = benchStore(n, setting.dimension, setting.clusters);
+        vector<float> queries = benchQueries(nq, n);
+
+        long evaluations = 0;
+        int mismatches = 0;
+        double pruned = 0.0, brute = 0.0;
+        for (int q = 0; q < nq; ++q) {
+            vector<float> query(queries.begin() + (size_t)q * setting.dimension,
+                                queries.begin() + (size_t)(q + 1) * setting.dimension);
+            evaluations += store->exactSearchEvaluations(query, k);
+
+            auto start = chrono::steady_clock::now();
+            int* fast = store->topKNearest(query, k, EUCLIDEAN, true);
+            pruned += secondsSince(start);
+
+            start = chrono::steady_clock::now();
+            int* full = store->topKNearestBatch(query.data(), 1, k, EUCLIDEAN);
+            brute += secondsSince(start);
+
+            if (!equal(fast, fast + k, full)) ++mismatches;
+            delete[] fast;
+            delete[] full;
+        }
+
+        double perQuery = (double)evaluations / nq;
+        cout << "dim " << setting.dimension << ", " << setting.clusters << " cluster(s): "
+             << perQuery << " of " << n << " records scored (" << 100.0 * (1.0 - perQuery / n)
+             << "% saved), pruned " << pruned / nq * 1e3 << "ms vs brute force " << brute / nq * 1e3
+             << "ms per query, " << mismatches << " mismatches" << endl;
+        delete store;
+    }
+    return 0;
+}
+
+// =====================================
+// fixed: FixedVectorStore<Dim> vs VectorStore
+// =====================================
+template <int Dim>
+static void compareFixedStore(int n, int nq) {
+    const int k = 10;
+    const double radius = 0.9;
+    VectorStore* dynamicStore = benchStore(n, Dim, 16);
+    FixedVectorStore<Dim> fixedStore(benchEmbedding, vector<float>(Dim, 0.0f));
+    for (int i = 0; i < n; ++i) fixedStore.addText(to_string(i));
+    vector<float> queries = benchQueries(nq, n);
+
+    double dynamicTopK = 0.0, fixedTopK = 0.0, dynamicRange = 0.0, fixedRange = 0.0;
+    int mismatches = 0;
+    for (int q = 0; q < nq; ++q) {
+        vector<float> query(queries.begin() + (size_t)q * Dim, queries.begin() + (size_t)(q + 1) * Dim);
+
+        auto start = chrono::steady_clock::now();
+        int* a = dynamicStore->topKNearest(query, k, COSINE);
+        dynamicTopK += secondsSince(start);
+        start = chrono::steady_clock::now();
+        int* b = fixedStore.topKNearest(query, k, COSINE);
+        fixedTopK += secondsSince(start);
+        if (!equal(a, a + k, b)) ++mismatches;
+        delete[] a;
+        delete[] b;
+
+        start = chrono::steady_clock::now();
+        int* c = dynamicStore->rangeQuery(query, radius, COSINE);
+        dynamicRange += secondsSince(start);
+        start = chrono::steady_clock::now();
+        int* d = fixedStore.rangeQuery(query, radius, COSINE);
+        fixedRange += secondsSince(start);
+        delete[] c;
+        delete[] d;
+    }
+
+    cout << "dim " << Dim << ", n = " << n << ": topKNearest " << dynamicTopK / nq * 1e3 << "ms vs fixed "
+         << fixedTopK / nq * 1e3 << "ms, rangeQuery " << dynamicRange / nq * 1e3 << "ms vs fixed "
+         << fixedRange / nq * 1e3 << "ms per query, " << mismatches << " top-k mismatches" << endl;
+    delete dynamicStore;
+}
+
+static int benchFixedStore() {
+    compareFixedStore<384>(20000, 100);
+    compareFixedStore<768>(20000, 100);
+    compareFixedStore<1536>(10000, 100);
     return 0;
-}
\ No newline at end of file
+}
+
+// =====================================
+// scaling: rebuild and scans on 1..N threads
+// =====================================
+// Times setReferenceVector, which rebuilds both indexes through the
+// work-stealing scheduler, and on the pool a batched brute-force kNN scan
+// and one Euclidean findNearest scan per query, at each worker count. Speedups are against one
+// worker; counts past the hardware thread count show the cost of
+// oversubscription rather than any gain.
+static double timeRebuild(VectorStore& store, int dimension, int rounds) {
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) store.setReferenceVector(vector<float>(dimension, 0.1f * (r + 1)));
+    return secondsSince(start) / rounds;
+}
+
+static void scaleStore(const char* name, IndexKind indexKind, const vector<int>& counts) {
+    const int n = 200000, dimension = 64, nq = 64, k = 10;
+    VectorStore* store = benchStore(n, dimension, 16, indexKind);
+    vector<float> queries = benchQueries(nq, n);
+
+    cout << name << ", n = " << n << ", dim " << dimension << endl;
+    double rebuild1 = 0.0, scan1 = 0.0, nearest1 = 0.0;
+    int* expected = nullptr;
+    vector<int> expectedNearest;
+    for (int workers : counts) {
+        store->setWorkerCount(workers);
+        double rebuild = timeRebuild(*store, dimension, 3);
+
+        auto start = chrono::steady_clock::now();
+        int* ids = store->topKNearestBatch(queries.data(), nq, k, EUCLIDEAN);
+        double scan = secondsSince(start);
+
+        vector<int> nearestIds;
+        start = chrono::steady_clock::now();
+        for (int q = 0; q < nq; ++q) {
+            vector<float> query(queries.begin() + (size_t)q * dimension, queries.begin() + (size_t)(q + 1) * dimension);
+            nearestIds.push_back(store->findNearest(query, EUCLIDEAN));
+        }
+        double nearest = secondsSince(start);
+
+        bool same = true;
+        if (!expected) {
+            expected = ids;
+            expectedNearest = nearestIds;
+            rebuild1 = rebuild;
+            scan1 = scan;
+            nearest1 = nearest;
+        } else {
+            same = equal(ids, ids + (size_t)nq * k, expected) && nearestIds == expectedNearest;
+            delete[] ids;
+        }
+
+        cout << "  " << workers << " worker(s): rebuild " << rebuild * 1e3 << "ms (" << rebuild1 / rebuild
+             << "x), batch kNN " << scan * 1e3 << "ms (" << scan1 / scan << "x), Euclidean findNearest "
+             << nearest * 1e3 << "ms (" << nearest1 / nearest << "x)" << (same ? "" : ", results DIFFER") << endl;
+    }
+    delete[] expected;
+    delete store;
+}
+
+static int benchScaling() {
+    // 1, 2, 4, 8 and on up to the hardware thread count
+    int cores = max(1, (int)std::thread::hardware_concurrency());
+    vector<int> counts;
+    for (int workers = 1; workers < max(cores, 8); workers *= 2) counts.push_back(workers);
+    counts.push_back(max(cores, 8));
+
+    cout << cores << " hardware thread(s)" << endl;
+    scaleStore("AVL index", AVL_INDEX, counts);
+    scaleStore("B+ index", BPLUS_INDEX, counts);
+    return 0;
+}
+
+// =====================================
+// Driver
+// =====================================
+struct Command {
+    const char* name;
+    const char* help;
+    int (*run)();
+};
+
+static const Command COMMANDS[] = {
+    { "kernels", "check: SIMD distance kernels against the scalar ones, lengths 0..1536", checkKernels },
+    { "alloc", "benchmark: tree node churn, slab allocator vs new/delete", benchAllocator },
+    { "nodes", "benchmark: insert, contains and lowerBound on AVL and red-black trees at 1M keys", benchNodes },
+    { "fixed", "benchmark: FixedVectorStore<Dim> vs VectorStore on topKNearest and rangeQuery", benchFixedStore },
+    { "exact", "benchmark: distance evaluations of exact Euclidean kNN vs brute force", benchExactSearch },
+    { "scaling", "benchmark: index rebuild, batched kNN and findNearest on 1..N worker threads", benchScaling },
+};
+
+int main(int argc, char** argv) {
+    string name = argc > 1 ? argv[1] : "";
+    for (const Command& command : COMMANDS) {
+        if (name == command.name) return command.run();
+    }
+
+    cout << "usage: " << argv[0] << " <command>" << endl;
+    for (const Command& command : COMMANDS) {
+        cout << "  " << command.name << "\t" << command.help << endl;
+    }
+    return name.empty() ? 0 : 1;
+}
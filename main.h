@@ -7,7 +7,21 @@
 #include <stdexcept>
 #include <cmath>
 #include <vector>
+#include <array>
 #include <queue>
+#include <deque>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "utils.h"
 
 using namespace std;